@@ -0,0 +1,44 @@
+#include "BeatGrid.h"
+
+#include <algorithm>
+#include <exception>
+
+BeatGrid BeatGrid::Build(const std::vector<TimeSigTempoEvent>& markers, const TempoMap& tempo_map, int64_t end_tick) {
+  BeatGrid grid;
+  const int64_t ticks_per_whole = tempo_map.ticks_per_qn() * 4;
+  int64_t numerator = 4, denominator = 4;
+  int64_t segment_start = 0;
+  auto marker = markers.begin();
+  while (segment_start < end_tick) {
+    // Find where the next time signature takes over.
+    while (marker != markers.end() && (!marker->new_time_sig || marker->tick <= segment_start)) {
+      if (marker->new_time_sig) {
+        // A zero numerator or denominator can't be laid out as measures.
+        if (marker->numerator == 0 || marker->denominator == 0)
+          throw std::exception("Invalid time signature");
+        numerator = marker->numerator;
+        denominator = marker->denominator;
+      }
+      ++marker;
+    }
+    int64_t segment_end = marker == markers.end() ? end_tick : std::min(marker->tick, end_tick);
+    int64_t beat_length = std::max<int64_t>(ticks_per_whole / denominator, 1);
+    int64_t measure_length = std::max<int64_t>(beat_length * numerator, 1);
+    for (int64_t measure = segment_start; measure < segment_end; measure += measure_length) {
+      grid.measure_ticks.push_back(measure);
+      for (int64_t beat = 0; beat < numerator && measure + beat * beat_length < segment_end; beat++) {
+        grid.beat_ticks.push_back(measure + beat * beat_length);
+        grid.downbeats.push_back(beat == 0);
+      }
+    }
+    segment_start = segment_end;
+  }
+  grid.measure_times.resize(grid.measure_ticks.size());
+  tempo_map.TicksToSeconds(grid.measure_ticks.data(), grid.measure_times.data(), grid.measure_ticks.size());
+  return grid;
+}
+
+size_t BeatGrid::MeasureAt(int64_t tick) const {
+  auto it = std::upper_bound(measure_ticks.begin(), measure_ticks.end(), tick);
+  return it == measure_ticks.begin() ? 0 : (it - measure_ticks.begin()) - 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "SMF.h"
+
+// The measures and beats of a midi up to some tick, laid out in contiguous
+// arrays. A beat is one denominator note of the time signature in effect, and
+// every time signature change starts a new measure. Before the first time
+// signature the midi is in 4/4.
+struct BeatGrid {
+  // Builds the grid in one pass over the tempo / time signature markers.
+  // Throws an exception if a time signature before end_tick has a zero numerator
+  // or denominator.
+  static BeatGrid Build(const std::vector<TimeSigTempoEvent>& markers, const TempoMap& tempo_map, int64_t end_tick);
+
+  // Start tick of each measure.
+  std::vector<int64_t> measure_ticks;
+  // Start time of each measure, in seconds.
+  std::vector<double> measure_times;
+  // Tick of each beat.
+  std::vector<int64_t> beat_ticks;
+  // 1 for each beat that starts a measure, 0 for the rest.
+  std::vector<uint8_t> downbeats;
+
+  // Index of the measure that contains the tick.
+  size_t MeasureAt(int64_t tick) const;
+};
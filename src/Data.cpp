@@ -1,5 +1,6 @@
 #include "Data.h"
 
+#include <iterator>
 #include <map>
 #include <sstream>
 #include <stack>
@@ -19,7 +20,7 @@ Symbol::Symbol(const char* string) {
     }
   }
 }
-Symbol Symbol::Load(std::istream& stream) {
+Symbol Symbol::Load(ByteReader& stream) {
   auto str = read_symbol(stream);
   auto ret = Symbol(str.c_str());
   return ret;
@@ -40,7 +41,7 @@ void DataNode::operator=(const DataNode& other) {
   this->val = other.val;
   this->type = other.type;
 }
-void DataNode::Load(std::istream& stream) {
+void DataNode::Load(ByteReader& stream) {
   type = static_cast<DataType>(read<uint32_t>(stream));
   switch(type) {
     case DataType::INT:
@@ -78,12 +79,12 @@ void DataNode::Load(std::istream& stream) {
     case DataType::OBJECT:
     default: {
       std::stringstream ss;
-      ss << "Unhandled type " << (int)type << " at 0x" << std::hex << stream.tellg();
+      ss << "Unhandled type " << (int)type << " at 0x" << std::hex << stream.Tell();
       throw std::exception(ss.str().c_str());
     } break;
   }
 }
-void DataNode::Save(std::ostream& stream) const {
+void DataNode::Save(ByteWriter& stream) const {
   write(stream, static_cast<uint32_t>(type));
   switch (type) {
     case DataType::INT:
@@ -200,7 +201,7 @@ DataArray::DataArray(const DataArray& other) {
   content = other.content;
   line_num = other.line_num;
 }
-void DataArray::Load(std::istream& stream) {
+void DataArray::Load(ByteReader& stream) {
   auto node_id = read<int32_t>(stream);
   count = read<int16_t>(stream);
   line_num = read<int16_t>(stream);
@@ -210,7 +211,7 @@ void DataArray::Load(std::istream& stream) {
     n[i].Load(stream);
   }
 }
-void DataArray::Save(std::ostream& stream) const {
+void DataArray::Save(ByteWriter& stream) const {
   write<uint32_t>(stream, 1U);
   write(stream, count);
   write(stream, line_num);
@@ -218,10 +219,10 @@ void DataArray::Save(std::ostream& stream) const {
     nodes()[i].Save(stream);
   }
 }
-void DataArray::SaveGlob(std::ostream& stream) const {
+void DataArray::SaveGlob(ByteWriter& stream) const {
   write_symbol(stream, string());
 }
-void DataArray::LoadGlob(std::istream& stream, bool isGlob) {
+void DataArray::LoadGlob(ByteReader& stream, bool isGlob) {
   if (isGlob) {
     throw std::exception("Globs aren't supported, sorry");
   }
@@ -316,12 +317,12 @@ Symbol DataArray::FindSym(const std::string& name) {
   return FindArray(name)->Node(1).Sym();
 }
 
-// Tokenizes the whole stream
+// Tokenizes the whole text
 struct SourceToken {
   std::string value;
   int16_t line;
 };
-std::vector<SourceToken> Tokenize(std::istream& stream) {
+std::vector<SourceToken> Tokenize(std::string_view text) {
   enum class TokenizerState {
     whitespace,
     quoted_symbol,
@@ -330,9 +331,8 @@ std::vector<SourceToken> Tokenize(std::istream& stream) {
     comment
   } state = TokenizerState::whitespace;
   int16_t line = 1;
-  char c;
   std::vector<SourceToken> tokens;
-  while(stream.get(c)) {
+  for(char c : text) {
     if (c == '\n') {
       if (line == INT16_MAX) {
         throw std::exception("Too many lines of data :(");
@@ -497,8 +497,12 @@ std::string unescape(const std::string& string_literal) {
   return ss.str();
 }
 std::shared_ptr<DataArray> DataReadStream(std::istream& stream) {
+  std::string text{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+  return DataReadString(text);
+}
+std::shared_ptr<DataArray> DataReadString(std::string_view text) {
   auto ret = std::make_shared<DataArray>();
-  auto tokens = Tokenize(stream);
+  auto tokens = Tokenize(text);
   std::map<char, DataType> array_types = {
     {'(', DataType::ARRAY}, {')', DataType::ARRAY},
     {'[', DataType::OBJECT_PROP_REF}, {']', DataType::OBJECT_PROP_REF},
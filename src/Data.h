@@ -1,6 +1,7 @@
 #include <memory>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <variant>
 #include <vector>
@@ -9,7 +10,7 @@
 
 struct Symbol {
   Symbol(const char* string = g_null_string);
-  static Symbol Load(std::istream& stream);
+  static Symbol Load(ByteReader& stream);
   bool operator==(const Symbol& that) const;
   const char* Str() const;
   static void PrintSymTab();
@@ -70,10 +71,10 @@ struct DataArray {
     content = std::string(str);
   }
   DataArray(const DataArray& other);
-  void Load(std::istream& stream);
-  void Save(std::ostream& stream) const;
-  void SaveGlob(std::ostream& stream) const;
-  void LoadGlob(std::istream& stream, bool isGlob);
+  void Load(ByteReader& stream);
+  void Save(ByteWriter& stream) const;
+  void SaveGlob(ByteWriter& stream) const;
+  void LoadGlob(ByteReader& stream, bool isGlob);
   void Print(std::ostream& stream, int indent = 0) const;
   void Resize(short count);
   void PushBack(const DataNode& node);
@@ -101,6 +102,7 @@ struct DataArray {
 };
 
 std::shared_ptr<DataArray> DataReadStream(std::istream& stream);
+std::shared_ptr<DataArray> DataReadString(std::string_view text);
 
 typedef DataNode (*DataFuncType)(DataArray* args);
 
@@ -133,8 +135,8 @@ struct DataNode {
     this->type = DataType::EMPTY;
   }
   void operator=(const DataNode& other);
-  void Load(std::istream& stream);
-  void Save(std::ostream& stream) const;
+  void Load(ByteReader& stream);
+  void Save(ByteWriter& stream) const;
   void Print(std::ostream& stream, int indent = 0, bool escape = true) const;
   bool NotNull() const;
 
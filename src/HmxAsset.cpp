@@ -2,7 +2,7 @@
 
 #include "stream-helpers.h"
 
-ResourceFile LoadResource(std::istream& stream) {
+ResourceEntry ReadResourceEntry(ByteReader& stream) {
   auto unk1 = read<int32_t>(stream);
   auto filename = read_ue4text(stream);
   auto unk2 = read<int32_t>(stream);
@@ -10,14 +10,19 @@ ResourceFile LoadResource(std::istream& stream) {
   uint64_t size = read<uint64_t>(stream);
   if (size > SIZE_MAX)
     throw std::exception("Resource was way too big.");
-  auto data = std::string((size_t)size, '\0');
-  stream.read(data.data(), data.size());
-  return {unk1, filename, unk2, type, data};
+  auto offset = stream.Tell();
+  stream.Skip((size_t)size);
+  return {unk1, filename, unk2, type, offset, (size_t)size};
 }
 
 constexpr int SUPPORTED_VERSION = 7;
-HmxAsset HmxAsset::LoadAsset(std::istream& stream) {
-  HmxAsset asset;
+HmxAsset HmxAsset::LoadAsset(ByteReader& stream) {
+  return LazyHmxAsset::Open(stream).ToHmxAsset();
+}
+
+LazyHmxAsset LazyHmxAsset::Open(ByteReader& stream) {
+  LazyHmxAsset lazy(stream.data(), stream.size());
+  auto& asset = lazy.asset_;
   asset.version_ = read<uint64_t>(stream);
   if (asset.version_ != SUPPORTED_VERSION)
     throw std::exception("Unsupported asset type");
@@ -36,12 +41,27 @@ HmxAsset HmxAsset::LoadAsset(std::istream& stream) {
     num_files = read<int64_t>(stream);
   }
   for(int64_t i = 0; i < num_files; i++) {
-    asset.files_.push_back(LoadResource(stream));
+    lazy.resources_.push_back(ReadResourceEntry(stream));
   }
   asset.magic_footer_ = read<uint32_t>(stream);
   if (asset.magic_footer_ != MAGIC) {
     throw std::exception("Unexpected asset footer bytes.");
   }
+  return lazy;
+}
+
+std::string_view LazyHmxAsset::GetData(const ResourceEntry& resource) const {
+  if (resource.offset > size_ || resource.size > size_ - resource.offset)
+    throw std::exception("Resource is outside the asset");
+  return { (const char*)data_ + resource.offset, resource.size };
+}
+
+HmxAsset LazyHmxAsset::ToHmxAsset() const {
+  HmxAsset asset = asset_;
+  asset.files_.reserve(resources_.size());
+  for(const auto& resource : resources_) {
+    asset.files_.push_back({resource.unk_1, resource.filename, resource.unk_2, resource.type, std::string(GetData(resource))});
+  }
   return asset;
 }
 
@@ -53,4 +73,14 @@ std::vector<const ResourceFile*> HmxAsset::GetResourcesOfType(const std::string&
     }
   }
   return ret;
+}
+
+std::vector<const ResourceEntry*> LazyHmxAsset::GetResourcesOfType(const std::string& type) const {
+  std::vector<const ResourceEntry*> ret;
+  for(const auto& resource : resources_) {
+    if (resource.type == type) {
+      ret.push_back(&resource);
+    }
+  }
+  return ret;
 }
\ No newline at end of file
@@ -2,8 +2,11 @@
 
 #include <stdint.h>
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <vector>
 
+class ByteReader;
 struct ResourceFile;
 
 // ??? Seems like 
@@ -21,7 +24,7 @@ constexpr uint32_t MAGIC = 0x9E2A83C1;
 class HmxAsset {
 public:
   // Loads an asset and its resources entirely into memory.
-  static HmxAsset LoadAsset(std::istream& stream);
+  static HmxAsset LoadAsset(ByteReader& stream);
   std::vector<const ResourceFile*> GetResourcesOfType(const std::string& type);
   uint64_t version_{};
   AssetSubtype subtype_{};
@@ -40,4 +43,43 @@ struct ResourceFile {
   int32_t unk_2;
   std::string type;
   std::string data;
+};
+
+// A resource header, with the payload left where it is in the asset.
+struct ResourceEntry {
+  int32_t unk_1;
+  std::string filename;
+  int32_t unk_2;
+  std::string type;
+  // Where the payload starts in the asset's stream.
+  size_t offset;
+  size_t size;
+};
+
+// An asset whose resource payloads are only read when they're asked for.
+// Opening it reads the resource headers and steps over each payload, so
+// listing a mapped asset only touches the pages the headers are on. The
+// stream's data must outlive it and the payloads it hands out.
+class LazyHmxAsset {
+public:
+  // Reads the asset and resource headers. Throws an exception if there's an issue.
+  static LazyHmxAsset Open(ByteReader& stream);
+
+  // The asset header fields, with files_ left empty.
+  const HmxAsset& asset() const { return asset_; }
+  const std::vector<ResourceEntry>& resources() const { return resources_; }
+  std::vector<const ResourceEntry*> GetResourcesOfType(const std::string& type) const;
+  // The payload of one of this asset's resources, in place. Throws an exception
+  // if the resource doesn't lie within the asset.
+  std::string_view GetData(const ResourceEntry& resource) const;
+  // Copies every payload into a full HmxAsset.
+  HmxAsset ToHmxAsset() const;
+
+private:
+  LazyHmxAsset(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  const uint8_t* data_;
+  size_t size_;
+  HmxAsset asset_;
+  std::vector<ResourceEntry> resources_;
 };
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile(const char* path) {
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return;
+  LARGE_INTEGER file_size;
+  if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &file_size)
+      && file_size.QuadPart > 0 && (uint64_t)file_size.QuadPart <= SIZE_MAX) {
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping) {
+      // The view keeps the mapping alive, so both handles can be closed now.
+      data_ = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+      if (data_) {
+        size_ = (size_t)file_size.QuadPart;
+        mapped_ = true;
+        open_ = true;
+        CloseHandle(file);
+        return;
+      }
+    }
+  }
+  // Fall back to reading the whole thing.
+  char chunk[65536];
+  DWORD read;
+  while (ReadFile(file, chunk, sizeof(chunk), &read, nullptr) && read > 0) {
+    buffer_.insert(buffer_.end(), chunk, chunk + read);
+  }
+  CloseHandle(file);
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  open_ = true;
+}
+
+MappedFile::~MappedFile() {
+  if (mapped_)
+    UnmapViewOfFile(data_);
+}
+#else
+MappedFile::MappedFile(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      // All of the parsers walk the file front to back.
+      madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+      data_ = (const uint8_t*)addr;
+      size_ = (size_t)st.st_size;
+      mapped_ = true;
+      open_ = true;
+      close(fd);
+      return;
+    }
+  }
+  // Fall back to reading the whole thing.
+  char chunk[65536];
+  ssize_t count;
+  while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+    buffer_.insert(buffer_.end(), chunk, chunk + count);
+  }
+  close(fd);
+  if (count < 0)
+    return;
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  open_ = true;
+}
+
+MappedFile::~MappedFile() {
+  if (mapped_)
+    munmap((void*)data_, size_);
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string_view>
+#include <vector>
+
+#include "stream-helpers.h"
+
+// Read-only view of an entire input file. Regular files are memory-mapped;
+// anything that can't be mapped (pipes, character devices, empty files) is
+// read into memory instead, so callers always see one contiguous buffer.
+class MappedFile {
+public:
+  explicit MappedFile(const char* path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_open() const { return open_; }
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+  std::string_view view() const { return { (const char*)data_, size_ }; }
+  // Returns a new reader positioned at the start of the file.
+  ByteReader Reader() const { return ByteReader(data_, size_); }
+
+private:
+  bool open_{ false };
+  bool mapped_{ false };
+  const uint8_t* data_{ nullptr };
+  size_t size_{ 0 };
+  // Backing storage when the file could not be mapped.
+  std::vector<uint8_t> buffer_;
+};
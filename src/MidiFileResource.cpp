@@ -1,9 +1,22 @@
 #include "MidiFileResource.h"
 
 #include <cmath>
-#include <sstream>
+#include <cstdarg>
+#include <cstdio>
+#include <deque>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
 
+#include "BeatGrid.h"
+#include "MidiFileResourceView.h"
+#include "parallel-helpers.h"
 #include "stream-helpers.h"
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
 constexpr int TICKS_PER_QN = 480;
 
 MidiFileResource MidiFileResource::FromMidi(MidiFile& mf) {
@@ -35,53 +48,63 @@ MidiFileResource MidiFileResource::FromMidi(MidiFile& mf) {
     }
   }
 
-  std::vector<uint32_t> measure_ticks;
-  measure_ticks.push_back(0);
-  auto last_time_sig = mf.tempo_timesig_map()[0];
+  mfr.FinishFromMidi(mf.tempo_timesig_map(), mf.tempo_map(), final_tick);
+  return mfr;
+}
+
+void MidiFileResource::FinishFromMidi(const std::vector<TimeSigTempoEvent>& markers, const TempoMap& tempo_map, tick_t final_tick) {
+  auto grid = BeatGrid::Build(markers, tempo_map, final_tick);
+  // Measures are counted the way fuser-util always has, not from the grid: a time
+  // signature change partway through a measure doesn't count that partial measure.
+  // Existing resources were written this way, and it hasn't been checked against
+  // the game's own files. Only the count and where the last counted measure starts
+  // are needed.
+  auto last_time_sig = markers.empty() ? TimeSigTempoEvent{0.0, 0, 120.0, true, false, 4, 4} : markers[0];
   int measure = 0;
-  for (auto& tempo : mf.tempo_timesig_map())
+  int64_t measures = 1;
+  int64_t last_measure_tick = 0;
+  for (auto& tempo : markers)
   {
     if (tempo.new_tempo)
-      mfr.tempos_.emplace_back(
+      tempos_.emplace_back(
         (float)(tempo.time * 1000.0),
         (tick_t)tempo.tick,
         (int32_t)(60000000 / (float)tempo.bpm));
     if (tempo.new_time_sig)
     {
+      if (tempo.numerator == 0 || tempo.denominator == 0)
+        throw std::exception("Invalid time signature");
       if (tempo.tick > 0)
       {
         auto elapsed = tempo.tick - last_time_sig.tick;
         auto ticksPerBeat = (TICKS_PER_QN * 4) / last_time_sig.denominator;
         measure += (int)(elapsed / ticksPerBeat / last_time_sig.numerator);
-        auto last_measure_tick = measure_ticks.back();
-        for (int i = measure_ticks.size(); i < measure; i++)
-        {
-          last_measure_tick += TICKS_PER_QN * last_time_sig.numerator * 4 / last_time_sig.denominator;
-          measure_ticks.push_back(last_measure_tick);
+        if (measure > measures) {
+          last_measure_tick += (measure - measures) * (TICKS_PER_QN * last_time_sig.numerator * 4 / last_time_sig.denominator);
+          measures = measure;
         }
       }
-      mfr.time_sigs_.emplace_back(measure, (tick_t)tempo.tick, tempo.numerator, tempo.denominator);
+      time_sigs_.emplace_back(measure, (tick_t)tempo.tick, tempo.numerator, tempo.denominator);
       last_time_sig = tempo;
     }
-  };
-  uint32_t last_timesig_ticks_per_measure = TICKS_PER_QN * last_time_sig.numerator * 4 / last_time_sig.denominator;
-  for (uint32_t last_measure_tick2 = measure_ticks.back() + last_timesig_ticks_per_measure;
-      last_measure_tick2 < final_tick;
-      last_measure_tick2 += last_timesig_ticks_per_measure) {
-    measure_ticks.push_back(last_measure_tick2);
-  }
-  mfr.fuser_revision_ = 2;
-  mfr.measures_ = measure_ticks.size();
-  mfr.final_tick_ = final_tick;
-  mfr.unknown_ints_ = {0, 0, 0, 0, 0, 0};
-  mfr.final_tick_minus_one_ = mfr.final_tick_ - 1;
-  mfr.unknown_floats_ = { -1.f, -1.f, -1.f, -1.f };
-  mfr.unknown_zero_ = 0;
+  }
+  // Then whole measures of the last time signature, up to the final tick.
+  int64_t last_timesig_ticks_per_measure = TICKS_PER_QN * last_time_sig.numerator * 4 / last_time_sig.denominator;
+  if (final_tick > last_measure_tick)
+    measures += (final_tick - last_measure_tick - 1) / last_timesig_ticks_per_measure;
+  beats_.reserve(grid.beat_ticks.size());
+  for (size_t i = 0; i < grid.beat_ticks.size(); i++)
+    beats_.push_back({(tick_t)grid.beat_ticks[i], grid.downbeats[i] != 0});
+  fuser_revision_ = 2;
+  measures_ = (uint32_t)measures;
+  final_tick_ = final_tick;
+  unknown_ints_ = {0, 0, 0, 0, 0, 0};
+  final_tick_minus_one_ = final_tick_ - 1;
+  unknown_floats_ = { -1.f, -1.f, -1.f, -1.f };
+  unknown_zero_ = 0;
   
-  mfr.fuser_revision_2_ = mfr.chords_.size() == 0 ? -1 : 2;
-  // BEATS would go here, but Fuser doesn't have beats?
+  fuser_revision_2_ = chords_.size() == 0 ? -1 : 2;
   // song sections would go here, but fuser doesn't have song sections?
-  return mfr;
 }
 
 MidiFile MidiFileResource::ExtractMidi() const {
@@ -92,16 +115,16 @@ MidiFile MidiFileResource::ExtractMidi() const {
   return MidiFile(MidiFormat::MultiTrack, tracks, TICKS_PER_QN);
 }
 
-MidiFileResource::Tempo ReadTempo(std::istream& stream) {
-  return {read<float>(stream), read<tick_t>(stream), read<int32_t>(stream)};
-}
-MidiFileResource::TimeSig ReadTimeSig(std::istream& stream) {
-  return {read<int32_t>(stream), read<tick_t>(stream), read<int16_t>(stream), read<int16_t>(stream)};
-}
-MidiFileResource::Beat ReadBeat(std::istream& stream) {
+// Tempos and time signatures are stored exactly as laid out in memory.
+static_assert(sizeof(MidiFileResource::Tempo) == 12, "Tempo must match its on-disk layout");
+static_assert(sizeof(MidiFileResource::TimeSig) == 12, "TimeSig must match its on-disk layout");
+template<> constexpr bool is_raw_layout_v<MidiFileResource::Tempo> = true;
+template<> constexpr bool is_raw_layout_v<MidiFileResource::TimeSig> = true;
+
+MidiFileResource::Beat ReadBeat(ByteReader& stream) {
   return {read<tick_t>(stream), (bool)read<uint8_t>(stream)};
 }
-MidiFileResource::Chord ReadChord(std::istream& stream) {
+MidiFileResource::Chord ReadChord(ByteReader& stream) {
   return {read_symbol(stream), read<tick_t>(stream), read<tick_t>(stream)};
 }
 enum class HmxEventType : uint8_t {
@@ -110,8 +133,15 @@ enum class HmxEventType : uint8_t {
   TimeSignature = 4,
   Meta = 8
 };
+uint16_t CheckStringIndex(uint16_t string_index, size_t num_strings) {
+  if (string_index >= num_strings) {
+    throw std::exception("Text event string index out of range");
+  }
+  return string_index;
+}
+
 TrackEvent ReadEvent(
-    std::istream& stream,
+    ByteReader& stream,
     uint32_t& midi_tick,
     std::string& track_name,
     std::vector<std::string>& track_strings) {
@@ -156,7 +186,7 @@ TrackEvent ReadEvent(
       auto num = read<uint8_t>(stream);
       auto denom = read<uint8_t>(stream);
       auto denom_pow2 = (uint8_t)log2(denom);
-      stream.get(); // skip 1 byte?
+      stream.Skip(1); // skip 1 byte?
       return TrackEvent{deltaTime, EventType::Meta, MetaEvent(MetaEventType::TimeSignature, TimeSignatureEvent{num, denom_pow2, 24, 8})};
     }
     case HmxEventType::Meta: {
@@ -166,106 +196,530 @@ TrackEvent ReadEvent(
       if (t < MetaEventType::Text || t > MetaEventType::CuePoint) {
         throw std::exception("Invalid text event type");
       }
+      const auto& str = track_strings[CheckStringIndex(string_index, track_strings.size())];
       if (t == MetaEventType::TrackName) {
-        track_name = track_strings[string_index];
+        track_name = str;
       }
-      return TrackEvent{deltaTime, EventType::Meta, MetaEvent(t, track_strings[string_index])};
+      return TrackEvent{deltaTime, EventType::Meta, MetaEvent(t, str)};
     }
     default:
       throw std::exception("Unknown midi track event");
   }
 }
 
-MidiFileResource::TrackWrapper ReadMidiTrack(std::istream& stream) {
+// Checks an 8-byte event record against the filter without decoding it.
+bool KeepRecord(const EventFilter& filter, const uint8_t* record) {
+  switch ((HmxEventType)record[4])
+  {
+    case HmxEventType::Midi:
+      return filter.Keeps(record[5], {});
+    case HmxEventType::Tempo:
+      return filter.Keeps(0xFF, MetaEventType::TempoEvent);
+    case HmxEventType::TimeSignature:
+      return filter.Keeps(0xFF, MetaEventType::TimeSignature);
+    case HmxEventType::Meta:
+      return filter.Keeps(0xFF, (MetaEventType)record[5]);
+    default: // let the decoder report it
+      return true;
+  }
+}
+
+// The string table index of a TrackName record, or -1 for any other record.
+// Used to pick up the track name when the record itself is filtered out.
+int TrackNameIndex(const uint8_t* record) {
+  if ((HmxEventType)record[4] != HmxEventType::Meta || (MetaEventType)record[5] != MetaEventType::TrackName)
+    return -1;
+  return record[6] | record[7] << 8;
+}
+
+MidiFileResource::TrackWrapper ReadMidiTrack(ByteReader& stream, const EventFilter& filter) {
   auto unk = read<uint8_t>(stream);
   auto unk2 = read<int32_t>(stream);
   auto num_events = read<uint32_t>(stream);
 
-  std::string events_data(num_events * 8, '\0');
-  stream.read(events_data.data(), num_events * 8ULL);
+  auto events_data = stream.Sub(num_events * 8ULL);
   std::vector<std::string> track_strings;
   read_vector<std::string>(stream, track_strings, read_symbol);
-  std::stringstream ss(events_data);
 
+  // Ticks are absolute, so skipped events fold into the next kept one on their own.
   uint32_t midi_tick = 0;
+  uint32_t last_tick = 0;
   std::string track_name = "";
   std::vector<TrackEvent> events;
   for(auto i = 0u; i < num_events; i++) {
-    events.push_back(ReadEvent(ss, midi_tick, track_name, track_strings));
+    const uint8_t* record = events_data.Current();
+    memcpy(&last_tick, record, sizeof(last_tick));
+    if (!KeepRecord(filter, record)) {
+      if (auto name_index = TrackNameIndex(record); name_index >= 0)
+        track_name = track_strings[CheckStringIndex(name_index, track_strings.size())];
+      events_data.Skip(8);
+      continue;
+    }
+    events.push_back(ReadEvent(events_data, midi_tick, track_name, track_strings));
+  }
+  events.emplace_back(last_tick - midi_tick, EventType::Meta, MetaEvent(MetaEventType::EndOfTrack));
+  return {unk2, {track_name, last_tick, events}};
+}
+
+// Decodes one 8-byte record into a compact track message if it's a midi message
+// record. Returns false for anything else, including invalid midi messages.
+bool DecodeMidiRecord(const uint8_t* record, uint32_t& tick, uint32_t& message) {
+  if ((HmxEventType)record[4] != HmxEventType::Midi)
+    return false;
+  uint8_t status = record[5], d2 = record[6], d3 = record[7];
+  switch ((EventType)(status & 0xF0))
+  {
+    case EventType::NoteOff:
+    case EventType::NoteOn:
+    case EventType::Controller:
+      message = status | d2 << 8 | d3 << 16;
+      break;
+    case EventType::ProgramChange:
+    case EventType::ChannelPressure:
+      message = status | d2 << 8;
+      break;
+    case EventType::PitchBend:
+      // Stored little-endian, the compact track keeps the bytes in midi order.
+      message = status | d3 << 8 | d2 << 16;
+      break;
+    default:
+      return false;
+  }
+  memcpy(&tick, record, sizeof(tick));
+  return true;
+}
+
+// Decodes the leading run of midi message records into tick and message columns,
+// returning how many were decoded. With SSE2, four records are decoded at once
+// until a block holds anything else, and the rest are done one at a time.
+size_t DecodeMidiRecords(const uint8_t* records, size_t count, uint32_t* ticks, uint32_t* messages) {
+  size_t i = 0;
+#ifdef HAVE_SSE2
+  const __m128i low_byte = _mm_set1_epi32(0xFF);
+  const __m128i type_mask = _mm_set1_epi32(0xF0);
+  const __m128i data2_byte = _mm_set1_epi32(0xFF0000);
+  const __m128i data1_byte = _mm_set1_epi32(0xFF00);
+  auto type_is = [](__m128i type, int value) { return _mm_cmpeq_epi32(type, _mm_set1_epi32(value)); };
+  for (; i + 4 <= count; i += 4) {
+    // Each record is a tick dword followed by a kind, d1, d2, d3 dword.
+    __m128i lo = _mm_loadu_si128((const __m128i*)(records + i * 8));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(records + i * 8 + 16));
+    lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+    hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i tick = _mm_unpacklo_epi64(lo, hi);
+    __m128i fields = _mm_unpackhi_epi64(lo, hi);
+
+    // Shifting out the kind leaves status, d2 and d3 where the compact message wants them.
+    __m128i message = _mm_srli_epi32(fields, 8);
+    __m128i type = _mm_and_si128(message, type_mask);
+    __m128i two_bytes = _mm_or_si128(type_is(type, 0xC0), type_is(type, 0xD0));
+    __m128i bend = type_is(type, 0xE0);
+    __m128i three_bytes = _mm_or_si128(_mm_or_si128(type_is(type, 0x80), type_is(type, 0x90)), type_is(type, 0xB0));
+    __m128i valid = _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(fields, low_byte), _mm_set1_epi32((int)HmxEventType::Midi)),
+      _mm_or_si128(_mm_or_si128(two_bytes, bend), three_bytes));
+    if (_mm_movemask_epi8(valid) != 0xFFFF)
+      break;
+
+    message = _mm_andnot_si128(_mm_and_si128(two_bytes, data2_byte), message);
+    __m128i swapped = _mm_or_si128(
+      _mm_and_si128(message, low_byte),
+      _mm_or_si128(
+        _mm_slli_epi32(_mm_and_si128(message, data1_byte), 8),
+        _mm_and_si128(_mm_srli_epi32(message, 8), data1_byte)));
+    message = _mm_or_si128(_mm_and_si128(bend, swapped), _mm_andnot_si128(bend, message));
+    _mm_storeu_si128((__m128i*)(ticks + i), tick);
+    _mm_storeu_si128((__m128i*)(messages + i), message);
+  }
+#endif
+  for (; i < count && DecodeMidiRecord(records + i * 8, ticks[i], messages[i]); i++);
+  return i;
+}
+
+// A track string interned into the file's payload arena.
+struct ArenaString {
+  uint32_t handle;
+  uint32_t length;
+};
+
+void ReadCompactEvent(ByteReader& stream, CompactTrack& track, const std::vector<ArenaString>& track_strings) {
+  auto tick = read<uint32_t>(stream);
+  auto kind = read<uint8_t>(stream);
+  auto d1 = read<uint8_t>(stream);
+  auto d2 = read<uint8_t>(stream);
+  auto d3 = read<uint8_t>(stream);
+  switch ((HmxEventType)kind)
+  {
+    case HmxEventType::Midi:
+      switch ((EventType)(d1 & 0xF0))
+      {
+        case EventType::NoteOff:
+        case EventType::NoteOn:
+        case EventType::Controller:
+          track.AddMidi(tick, d1, d2, d3, false);
+          return;
+        case EventType::ProgramChange:
+        case EventType::ChannelPressure:
+          track.AddMidi(tick, d1, d2, 0, false);
+          return;
+        case EventType::PitchBend:
+          // Stored little-endian, the compact track keeps the bytes in midi order.
+          track.AddMidi(tick, d1, d3, d2, false);
+          return;
+        default:
+          throw std::exception("Unknown midi message type encountered");
+      }
+    case HmxEventType::Tempo: {
+      uint8_t tempo[3] = {d1, d3, d2};
+      track.AddPayload(tick, 0xFF, MetaEventType::TempoEvent, tempo, 3);
+      return;
+    }
+    case HmxEventType::TimeSignature: {
+      uint8_t sig[4] = {d1, (uint8_t)log2(d2), 24, 8};
+      track.AddPayload(tick, 0xFF, MetaEventType::TimeSignature, sig, 4);
+      return;
+    }
+    case HmxEventType::Meta: {
+      MetaEventType t = (MetaEventType)d1;
+      if (t < MetaEventType::Text || t > MetaEventType::CuePoint) {
+        throw std::exception("Invalid text event type");
+      }
+      const auto& str = track_strings[CheckStringIndex(d2 | d3 << 8, track_strings.size())];
+      if (t == MetaEventType::TrackName) {
+        track.name.assign((const char*)track.arena->Data(str.handle), str.length);
+      }
+      track.AddPayload(tick, 0xFF, t, str.handle, str.length);
+      return;
+    }
+    default:
+      throw std::exception("Unknown midi track event");
   }
-  events.emplace_back(0, EventType::Meta, MetaEvent(MetaEventType::EndOfTrack));
-  return {unk2, {track_name, midi_tick, events}};
 }
 
-MidiFileResource MidiFileResource::Deserialize(std::istream& stream) {
+ArenaString ReadArenaString(ByteReader& stream, PayloadArena& arena) {
+  auto length = read<uint32_t>(stream);
+  return {arena.Intern(stream.Take(length), length), length};
+}
+
+MidiFileResource::CompactTrackWrapper ReadCompactMidiTrack(
+    ByteReader& stream,
+    const EventFilter& filter,
+    const std::shared_ptr<PayloadArena>& arena) {
+  auto unk = read<uint8_t>(stream);
+  auto unk2 = read<int32_t>(stream);
+  auto num_events = read<uint32_t>(stream);
+
+  // The string table is interned once, and text events point straight at it.
+  auto events_data = stream.Sub(num_events * 8ULL);
+  std::vector<ArenaString> track_strings;
+  read_vector<ArenaString>(stream, track_strings, [&](ByteReader& s) { return ReadArenaString(s, *arena); });
+
+  MidiFileResource::CompactTrackWrapper wrapper{unk2};
+  auto& track = wrapper.track;
+  track.arena = arena;
+  track.ticks.reserve(num_events + 1);
+  track.messages.reserve(num_events + 1);
+  uint32_t last_tick = 0;
+  if (num_events > 0)
+    memcpy(&last_tick, events_data.data() + (num_events - 1) * 8ULL, sizeof(last_tick));
+  bool keep_all = filter.KeepsAll();
+  // Runs of midi messages are decoded in bulk through a small buffer; other
+  // records and filtered reads go one record at a time.
+  uint32_t tick_buffer[256], message_buffer[256];
+  for (auto i = 0u; i < num_events;) {
+    const uint8_t* record = events_data.Current();
+    if (keep_all) {
+      auto count = DecodeMidiRecords(record, std::min<size_t>(num_events - i, std::size(tick_buffer)), tick_buffer, message_buffer);
+      if (count > 0) {
+        track.ticks.insert(track.ticks.end(), tick_buffer, tick_buffer + count);
+        track.messages.insert(track.messages.end(), message_buffer, message_buffer + count);
+        events_data.Skip(count * 8);
+        i += (uint32_t)count;
+        continue;
+      }
+    } else if (!KeepRecord(filter, record)) {
+      if (auto name_index = TrackNameIndex(record); name_index >= 0) {
+        const auto& str = track_strings[CheckStringIndex(name_index, track_strings.size())];
+        track.name.assign((const char*)arena->Data(str.handle), str.length);
+      }
+      events_data.Skip(8);
+      i++;
+      continue;
+    }
+    ReadCompactEvent(events_data, track, track_strings);
+    i++;
+  }
+  track.total_ticks = last_tick;
+  track.AddPayload((uint32_t)track.total_ticks, 0xFF, MetaEventType::EndOfTrack, nullptr, 0);
+  return wrapper;
+}
+
+// Steps over a serialized track without decoding it, returning its event count.
+uint32_t SkipMidiTrack(ByteReader& stream) {
+  stream.Skip(sizeof(uint8_t) + sizeof(int32_t));
+  auto num_events = read<uint32_t>(stream);
+  stream.Skip(num_events * 8ULL);
+  auto num_strings = read<uint32_t>(stream);
+  for (auto i = 0u; i < num_strings; i++)
+    stream.Skip(read<uint32_t>(stream));
+  return num_events;
+}
+
+// Hack: It seems like we need some way to preserve the final_tick for round-trip conversion
+// to work. The original midi's end-of-track events are not saved, so the best we can do is
+// set the first track's end-of-track event to the final tick.
+void EndAtFinalTick(MidiTrack& track, uint32_t final_tick) {
+  track.events.back().delta_time += (uint32_t)(final_tick - track.total_ticks);
+  track.total_ticks = final_tick;
+}
+
+// Writes the track's 8-byte event records as midi events. The end-of-track event
+// goes at end_tick if given, or else right after the last record.
+void ExtractMidiTrack(ByteReader& stream, ByteWriter& midi, std::optional<uint32_t> end_tick) {
+  stream.Skip(sizeof(uint8_t) + sizeof(int32_t));
+  auto num_events = read<uint32_t>(stream);
+  auto events_data = stream.Sub(num_events * 8ULL);
+  std::vector<std::string_view> track_strings;
+  read_vector<std::string_view>(stream, track_strings, [](ByteReader& s) {
+    auto length = read<uint32_t>(s);
+    return std::string_view((const char*)s.Take(length), length);
+  });
+
+  auto length_pos = BeginMidiTrack(midi);
+  uint8_t running_status = 0;
+  uint32_t midi_tick = 0;
+  for (auto i = 0u; i < num_events; i++) {
+    auto tick = read<uint32_t>(events_data);
+    auto kind = read<uint8_t>(events_data);
+    auto d1 = read<uint8_t>(events_data);
+    auto d2 = read<uint8_t>(events_data);
+    auto d3 = read<uint8_t>(events_data);
+    write_mb(midi, tick - midi_tick);
+    midi_tick = tick;
+    switch ((HmxEventType)kind)
+    {
+      case HmxEventType::Midi: {
+        auto type = (EventType)(d1 & 0xF0);
+        if (type != EventType::NoteOff && type != EventType::NoteOn && type != EventType::Controller &&
+            type != EventType::ProgramChange && type != EventType::ChannelPressure && type != EventType::PitchBend) {
+          throw std::exception("Unknown midi message type encountered");
+        }
+        if (d1 != running_status) {
+          midi.Put((char)d1);
+          running_status = d1;
+        }
+        if (type == EventType::PitchBend) {
+          // Stored little-endian.
+          midi.Put((char)d3);
+          midi.Put((char)d2);
+        } else {
+          midi.Put((char)d2);
+          if (type != EventType::ProgramChange && type != EventType::ChannelPressure)
+            midi.Put((char)d3);
+        }
+        break;
+      }
+      case HmxEventType::Tempo: {
+        uint8_t tempo[6] = {0xFF, (uint8_t)MetaEventType::TempoEvent, 3, d1, d3, d2};
+        midi.Write(tempo, sizeof(tempo));
+        break;
+      }
+      case HmxEventType::TimeSignature: {
+        uint8_t sig[7] = {0xFF, (uint8_t)MetaEventType::TimeSignature, 4, d1, (uint8_t)log2(d2), 24, 8};
+        midi.Write(sig, sizeof(sig));
+        break;
+      }
+      case HmxEventType::Meta: {
+        MetaEventType t = (MetaEventType)d1;
+        if (t < MetaEventType::Text || t > MetaEventType::CuePoint) {
+          throw std::exception("Invalid text event type");
+        }
+        auto str = track_strings[CheckStringIndex(d2 | d3 << 8, track_strings.size())];
+        midi.Put((char)0xFF);
+        midi.Put((char)t);
+        write_mb(midi, (uint32_t)str.size());
+        midi.Write(str.data(), str.size());
+        break;
+      }
+      default:
+        throw std::exception("Unknown midi track event");
+    }
+  }
+  write_mb(midi, end_tick.value_or(midi_tick) - midi_tick);
+  uint8_t end_of_track[3] = {0xFF, (uint8_t)MetaEventType::EndOfTrack, 0};
+  midi.Write(end_of_track, sizeof(end_of_track));
+  EndMidiTrack(midi, length_pos);
+}
+
+void MidiFileResource::ExtractMidi(ByteReader& stream, ByteWriter& midi) {
+  // The first track ends at the final tick, which comes after the tracks, so index them first.
+  auto index = LazyMidiFileResource::Open(stream);
+  const auto& tracks = index.tracks_;
+  auto final_tick = index.resource_.final_tick_;
+
+  WriteMidiHeader(midi, MidiFormat::MultiTrack, (uint16_t)tracks.size(), TICKS_PER_QN);
+  parallel_write(midi, tracks.size(), [&](ByteWriter& track_midi, size_t i) {
+    auto track = stream;
+    track.Seek(tracks[i].offset);
+    // Like Deserialize, the first track ends at the final tick.
+    ExtractMidiTrack(track, track_midi, i == 0 ? std::optional<uint32_t>(final_tick) : std::nullopt);
+  });
+}
+
+MidiFileResource MidiFileResource::Deserialize(ByteReader& stream, bool compact, const EventFilter& filter) {
   MidiFileResource r;
   r.magic_ = read<int32_t>(stream);
   if (r.magic_ != 2) {
     throw std::exception("Only MidiFileResource rev 2 is supported");
   }
   r.last_track_final_tick_ = read<uint32_t>(stream);
-  read_vector<TrackWrapper>(stream, r.tracks_, ReadMidiTrack);
-  auto finalTickOrRev = read<uint32_t>(stream);
-  if (finalTickOrRev == 0x56455223) { // '#REV'
-    r.fuser_revision_ = read<int32_t>(stream);
-    r.final_tick_ = read<uint32_t>(stream);
+  if (compact) {
+    auto arena = std::make_shared<PayloadArena>();
+    read_vector<CompactTrackWrapper>(stream, r.compact_tracks_, [&](ByteReader& s) { return ReadCompactMidiTrack(s, filter, arena); });
   } else {
-    r.fuser_revision_ = 0;
-    r.final_tick_ = finalTickOrRev;
+    read_vector<TrackWrapper>(stream, r.tracks_, [&](ByteReader& s) { return ReadMidiTrack(s, filter); });
   }
+  r.DeserializeTrailer(stream);
   if (r.tracks_.size() > 0) {
-    // Hack: It seems like we need some way to preserve the final_tick for round-trip conversion
-    // to work. The original midi's end-of-track events are not saved, so the best we can do is
-    // set the first track's end-of-track event to the final tick.
-    auto& track = r.tracks_[0].track;
-    track.events.back().delta_time = (uint32_t)(r.final_tick_ - track.total_ticks);
+    EndAtFinalTick(r.tracks_[0].track, r.final_tick_);
+  }
+  if (r.compact_tracks_.size() > 0) {
+    auto& track = r.compact_tracks_[0].track;
+    track.ticks.back() = r.final_tick_;
     track.total_ticks = r.final_tick_;
   }
-  r.measures_ = read<uint32_t>(stream);
-  read_array<uint32_t>(stream, r.unknown_ints_.data(), r.unknown_ints_.size(), read<uint32_t>);
-  r.final_tick_minus_one_ = read<uint32_t>(stream);
-  read_array<float>(stream, r.unknown_floats_.data(), r.unknown_floats_.size(), read<float>);
-  read_vector<Tempo>(stream, r.tempos_, ReadTempo);
-  read_vector<TimeSig>(stream, r.time_sigs_, ReadTimeSig);
-  read_vector<Beat>(stream, r.beats_, ReadBeat);
-  r.unknown_zero_ = read<int32_t>(stream);
-  if (r.fuser_revision_ > 1)
+  return r;
+}
+
+void MidiFileResource::DeserializeTrailer(ByteReader& stream) {
+  auto finalTickOrRev = read<uint32_t>(stream);
+  if (finalTickOrRev == 0x56455223) { // '#REV'
+    fuser_revision_ = read<int32_t>(stream);
+    final_tick_ = read<uint32_t>(stream);
+  } else {
+    fuser_revision_ = 0;
+    final_tick_ = finalTickOrRev;
+  }
+  measures_ = read<uint32_t>(stream);
+  read_array(stream, unknown_ints_.data(), unknown_ints_.size());
+  final_tick_minus_one_ = read<uint32_t>(stream);
+  read_array(stream, unknown_floats_.data(), unknown_floats_.size());
+  read_vector(stream, tempos_);
+  read_vector(stream, time_sigs_);
+  read_vector<Beat>(stream, beats_, ReadBeat);
+  unknown_zero_ = read<int32_t>(stream);
+  if (fuser_revision_ > 1)
   {
-    r.fuser_revision_2_ = read<int32_t>(stream);
-    read_vector<Chord>(stream, r.chords_, ReadChord);
+    fuser_revision_2_ = read<int32_t>(stream);
+    read_vector<Chord>(stream, chords_, ReadChord);
   }
-  read_vector<std::string>(stream, r.track_names_, read_symbol);
-  return r;
+  read_vector<std::string>(stream, track_names_, read_symbol);
+}
+
+LazyMidiFileResource LazyMidiFileResource::Open(ByteReader& stream) {
+  LazyMidiFileResource mfr(stream.data(), stream.size());
+  auto& r = mfr.resource_;
+  r.magic_ = read<int32_t>(stream);
+  if (r.magic_ != 2) {
+    throw std::exception("Only MidiFileResource rev 2 is supported");
+  }
+  r.last_track_final_tick_ = read<uint32_t>(stream);
+  // Tracks are added as they're stepped over, so a bogus count runs out of data first.
+  auto num_tracks = read<uint32_t>(stream);
+  for (auto i = 0u; i < num_tracks; i++) {
+    auto offset = stream.Tell();
+    mfr.tracks_.push_back({offset, SkipMidiTrack(stream)});
+  }
+  r.DeserializeTrailer(stream);
+  for (size_t i = 0; i < r.track_names_.size(); i++)
+    mfr.names_.emplace(r.track_names_[i], i);
+  return mfr;
+}
+
+const MidiFileResource::TrackWrapper& LazyMidiFileResource::GetTrack(size_t index) {
+  auto& track = tracks_.at(index);
+  if (!track.track)
+  {
+    ByteReader reader(data_, size_);
+    reader.Seek(track.offset);
+    auto wrapper = ReadMidiTrack(reader, EventFilter());
+    if (index == 0)
+      EndAtFinalTick(wrapper.track, resource_.final_tick_);
+    track.track = std::move(wrapper);
+  }
+  return *track.track;
 }
-void WriteTempo(std::ostream& stream, const MidiFileResource::Tempo& tempo) {
-  write(stream, tempo.start_millis);
-  write(stream, tempo.start_ticks);
-  write(stream, tempo.tempo);
+
+const MidiFileResource::TrackWrapper* LazyMidiFileResource::GetTrackByName(const std::string& name) {
+  auto it = names_.find(name);
+  if (it == names_.end() || it->second >= tracks_.size())
+    return nullptr;
+  return &GetTrack(it->second);
 }
-void WriteTimeSig(std::ostream& stream, const MidiFileResource::TimeSig& ts) {
-  write(stream, ts.measure);
-  write(stream, ts.tick);
-  write(stream, ts.numerator);
-  write(stream, ts.denominator);
+
+MidiFileResource LazyMidiFileResource::ToMidiFileResource() {
+  parallel_for(tracks_.size(), [&](size_t i) {
+    GetTrack(i);
+  });
+  MidiFileResource r = resource_;
+  r.tracks_.reserve(tracks_.size());
+  for (const auto& track : tracks_)
+    r.tracks_.push_back(*track.track);
+  return r;
 }
-void WriteBeat(std::ostream& stream, const MidiFileResource::Beat& beat) {
+
+void WriteBeat(ByteWriter& stream, const MidiFileResource::Beat& beat) {
   write(stream, beat.tick);
   write(stream, (uint8_t)beat.downbeat);
 }
-void WriteChord(std::ostream& stream, const MidiFileResource::Chord& chord) {
+void WriteChord(ByteWriter& stream, const MidiFileResource::Chord& chord) {
   write_symbol(stream, chord.name);
   write(stream, chord.start);
   write(stream, chord.end);
 }
 
-void WriteTrack(std::ostream& stream, const MidiFileResource::TrackWrapper& wrapper) {
+// A track's string table as it's written. Text events refer to their string by
+// a 16-bit index, and repeated strings like lyrics and chord names share one.
+class TrackStringTable {
+public:
+  uint16_t Add(const char* data, size_t length) {
+    auto it = indices_.find(std::string_view(data, length));
+    if (it != indices_.end())
+      return it->second;
+    if (strings_.size() > UINT16_MAX)
+      throw std::exception("Track has more distinct strings than text events can refer to");
+    uint16_t index = (uint16_t)strings_.size();
+    // Deque elements don't move, so the map can key on views of them.
+    strings_.emplace_back(data, length);
+    indices_.emplace(strings_.back(), index);
+    return index;
+  }
+  uint16_t Add(const std::string& str) { return Add(str.data(), str.size()); }
+
+  const std::string& operator[](uint16_t index) const { return strings_[index]; }
+  void Clear() {
+    strings_.clear();
+    indices_.clear();
+  }
+  void Write(ByteWriter& stream) const {
+    write<uint32_t>(stream, (uint32_t)strings_.size());
+    for (const auto& str : strings_)
+      write_symbol(stream, str);
+  }
+
+private:
+  std::deque<std::string> strings_;
+  std::unordered_map<std::string_view, uint16_t> indices_;
+};
+
+void WriteTrack(ByteWriter& stream, const MidiFileResource::TrackWrapper& wrapper) {
   const auto& track = wrapper.track;
   write<uint8_t>(stream, 1);
   write(stream, wrapper.unk);
   
   // Subtract 1 for the end-of-track event
-  write(stream, track.events.size() - 1);
-  std::vector<std::string> track_strings;
+  write<uint32_t>(stream, (uint32_t)track.events.size() - 1);
+  TrackStringTable track_strings;
   uint32_t ticks = 0;
   for (const auto& event : track.events) {
     uint8_t kind, d1, d2, d3;
@@ -298,7 +752,7 @@ void WriteTrack(std::ostream& stream, const MidiFileResource::TrackWrapper& wrap
       }
     }
     else if(event.type == EventType::Meta) {
-      auto meta = std::get<MetaEvent>(event.inner_event);
+      const auto& meta = std::get<MetaEvent>(event.inner_event);
       if (meta.type == MetaEventType::TempoEvent) {
         kind = 2;
         uint32_t tempo = std::get<uint32_t>(meta.event);
@@ -309,11 +763,10 @@ void WriteTrack(std::ostream& stream, const MidiFileResource::TrackWrapper& wrap
         kind = 4;
         auto ts = std::get<TimeSignatureEvent>(meta.event);
         d1 = ts.numerator;
-        d2 = 1 << ts.denominator;
+        d2 = TimeSignatureDenominator(ts.denominator);
         d3 = 0;
       } else if (meta.type >= MetaEventType::Text && meta.type <= MetaEventType::CuePoint) {
-        uint16_t idx = (uint16_t)track_strings.size();
-        track_strings.push_back(std::get<std::string>(meta.event));
+        uint16_t idx = track_strings.Add(std::get<std::string>(meta.event));
         kind = 8;
         d1 = (uint8_t)meta.type;
         d2 = idx & 0xff;
@@ -334,24 +787,101 @@ void WriteTrack(std::ostream& stream, const MidiFileResource::TrackWrapper& wrap
     write(stream, d2);
     write(stream, d3);
   }
-  write_vector<std::string>(stream, track_strings, write_symbol);
+  track_strings.Write(stream);
 }
 
-void MidiFileResource::Serialize(std::ostream& stream) const {
+void WriteCompactTrack(ByteWriter& stream, const MidiFileResource::CompactTrackWrapper& wrapper) {
+  const auto& track = wrapper.track;
+  write<uint8_t>(stream, 1);
+  write(stream, wrapper.unk);
+
+  // End-of-track events are not saved, so the count is patched in afterwards.
+  auto count_pos = stream.Tell();
+  write<uint32_t>(stream, 0);
+  uint32_t num_events = 0;
+  TrackStringTable track_strings;
+  for (size_t i = 0; i < track.size(); i++) {
+    uint8_t status = track.status(i);
+    uint8_t kind, d1, d2, d3;
+    if (IsChannelStatus(status)) {
+      kind = 1;
+      d1 = status;
+      if ((EventType)(status & 0xF0) == EventType::PitchBend) {
+        d2 = track.data2(i);
+        d3 = track.data1(i);
+      } else {
+        d2 = track.data1(i);
+        d3 = track.data2(i);
+      }
+    } else if (status == 0xFF) {
+      const auto& payload = track.payload(i);
+      const uint8_t* bytes = track.payload_bytes(payload);
+      if (payload.meta_type == MetaEventType::TempoEvent) {
+        kind = 2;
+        d1 = bytes[0];
+        d2 = bytes[2];
+        d3 = bytes[1];
+      } else if (payload.meta_type == MetaEventType::TimeSignature) {
+        kind = 4;
+        d1 = bytes[0];
+        d2 = TimeSignatureDenominator(bytes[1]);
+        d3 = 0;
+      } else if (payload.meta_type >= MetaEventType::Text && payload.meta_type <= MetaEventType::CuePoint) {
+        uint16_t idx = track_strings.Add((const char*)bytes, payload.length);
+        kind = 8;
+        d1 = (uint8_t)payload.meta_type;
+        d2 = idx & 0xff;
+        d3 = idx >> 8;
+      } else if (payload.meta_type == MetaEventType::EndOfTrack) {
+        // MidiFileResource does not save end-of-track events.
+        continue;
+      } else {
+        throw std::exception("Unhandled meta event type");
+      }
+    } else {
+      throw std::exception("Unhandled event type");
+    }
+    write(stream, track.ticks[i]);
+    write(stream, kind);
+    write(stream, d1);
+    write(stream, d2);
+    write(stream, d3);
+    num_events++;
+  }
+  patch(stream, count_pos, num_events);
+  track_strings.Write(stream);
+}
+
+void MidiFileResource::Serialize(ByteWriter& stream) const {
   write(stream, magic_);
   write(stream, last_track_final_tick_);
-  write_vector<TrackWrapper>(stream, tracks_, WriteTrack);
+  // Tracks don't share any state, so they're encoded concurrently.
+  if (compact_tracks_.size() > 0) {
+    write<uint32_t>(stream, (uint32_t)compact_tracks_.size());
+    parallel_write(stream, compact_tracks_.size(), [&](ByteWriter& track_stream, size_t i) {
+      WriteCompactTrack(track_stream, compact_tracks_[i]);
+    });
+  } else {
+    write<uint32_t>(stream, (uint32_t)tracks_.size());
+    parallel_write(stream, tracks_.size(), [&](ByteWriter& track_stream, size_t i) {
+      WriteTrack(track_stream, tracks_[i]);
+    });
+  }
+  SerializeTrailer(stream);
+}
+
+void MidiFileResource::SerializeTrailer(ByteWriter& stream) const {
   if (fuser_revision_ != 0) {
     write(stream, 0x56455223);
     write(stream, fuser_revision_);
   }
   write(stream, final_tick_);
   write(stream, measures_);
-  write_array<uint32_t>(stream, unknown_ints_.data(), unknown_ints_.size(), write<uint32_t>);
+  write_array(stream, unknown_ints_.data(), unknown_ints_.size());
   write(stream, final_tick_minus_one_);
-  write_array<float>(stream, unknown_floats_.data(), unknown_floats_.size(), write<float>);
-  write_vector<Tempo>(stream, tempos_, WriteTempo);
-  write_vector<TimeSig>(stream, time_sigs_, WriteTimeSig);
+  write_array(stream, unknown_floats_.data(), unknown_floats_.size());
+  write_vector(stream, tempos_);
+  write_vector(stream, time_sigs_);
   write_vector<Beat>(stream, beats_, WriteBeat);
   write(stream, unknown_zero_);
   if (fuser_revision_ != 0) {
@@ -359,4 +889,332 @@ void MidiFileResource::Serialize(std::ostream& stream) const {
     write_vector<Chord>(stream, chords_, WriteChord);
   }
   write_vector<std::string>(stream, track_names_, write_symbol);
-}
\ No newline at end of file
+}
+// Writes each event of a midi as a MidiFileResource record as it's parsed.
+// Only the current track's strings and chord texts are held in memory; the
+// track header fields that depend on the whole track are patched in at its end.
+class MidiConverter : public MidiVisitor {
+public:
+  MidiConverter(ByteWriter& stream) : stream_(stream) {}
+
+  void Header(MidiFormat format, uint16_t num_tracks, uint16_t ticks_per_qn) override {
+    if (ticks_per_qn != TICKS_PER_QN) {
+      throw std::exception("Midi must use 480 ticks per quarter note");
+    }
+    write(stream_, mfr_.magic_);
+    last_track_final_tick_pos_ = stream_.Tell();
+    write<uint32_t>(stream_, 0);
+    write<uint32_t>(stream_, num_tracks);
+  }
+
+  void TrackBegin(uint16_t track) override {
+    track_ = track;
+    name_.clear();
+    strings_.Clear();
+    texts_.clear();
+    num_events_ = 0;
+    write<uint8_t>(stream_, 1);
+    unk_pos_ = stream_.Tell();
+    write<int32_t>(stream_, -1);
+    count_pos_ = stream_.Tell();
+    write<uint32_t>(stream_, 0);
+  }
+
+  void ChannelMessage(int64_t tick, uint8_t status, uint8_t data1, uint8_t data2) override {
+    num_events_++;
+    // Pitch bends are stored most significant byte last.
+    if ((EventType)(status & 0xF0) == EventType::PitchBend)
+      WriteRecord(tick, HmxEventType::Midi, status, data2, data1);
+    else
+      WriteRecord(tick, HmxEventType::Midi, status, data1, data2);
+  }
+
+  void Meta(int64_t tick, MetaEventType type, const uint8_t* data, uint32_t length) override {
+    num_events_++;
+    if (type == MetaEventType::TempoEvent) {
+      if (track_ == 0)
+        tempo_map_.AddTempo(tick, data[0] << 16 | data[1] << 8 | data[2]);
+      WriteRecord(tick, HmxEventType::Tempo, data[0], data[2], data[1]);
+    } else if (type == MetaEventType::TimeSignature) {
+      if (track_ == 0)
+        tempo_map_.AddTimeSignature(tick, TimeSignatureEvent{data[0], data[1], data[2], data[3]});
+      WriteRecord(tick, HmxEventType::TimeSignature, data[0], TimeSignatureDenominator(data[1]), 0);
+    } else if (type >= MetaEventType::Text && type <= MetaEventType::CuePoint) {
+      uint16_t idx = strings_.Add((const char*)data, length);
+      if (type == MetaEventType::TrackName)
+        name_ = strings_[idx];
+      else if (type == MetaEventType::Text)
+        texts_.emplace_back((tick_t)tick, idx);
+      WriteRecord(tick, HmxEventType::Meta, (uint8_t)type, idx & 0xff, idx >> 8);
+    } else if (type != MetaEventType::EndOfTrack) {
+      // MidiFileResource does not save end-of-track events.
+      throw std::exception("Unhandled meta event type");
+    }
+  }
+
+  void Sysex(int64_t tick, uint8_t status, const uint8_t* data, uint32_t length) override {
+    throw std::exception("Unhandled event type");
+  }
+
+  void TrackEnd(uint16_t track, int64_t total_ticks) override {
+    patch<int32_t>(stream_, unk_pos_, name_ == "samplemidi" ? 0 : -1);
+    // Subtract 1 for the end-of-track event
+    patch<uint32_t>(stream_, count_pos_, num_events_ - 1);
+    strings_.Write(stream_);
+    mfr_.track_names_.push_back(name_);
+    if (name_ == "chords") {
+      for (const auto& [tick, index] : texts_) {
+        if (mfr_.chords_.size() > 0) {
+          mfr_.chords_.back().end = tick - 1;
+        }
+        mfr_.chords_.emplace_back(strings_[index], tick, -1);
+      }
+    }
+    if (total_ticks > final_tick_)
+      final_tick_ = (tick_t)total_ticks;
+    last_track_final_tick_ = (uint32_t)total_ticks;
+  }
+
+  // Writes everything that follows the tracks.
+  void Finish() {
+    patch(stream_, last_track_final_tick_pos_, last_track_final_tick_);
+    tempo_map_.Finish();
+    mfr_.FinishFromMidi(tempo_map_.markers(), tempo_map_.tempo_map(), final_tick_);
+    mfr_.SerializeTrailer(stream_);
+  }
+
+private:
+  void WriteRecord(int64_t tick, HmxEventType kind, uint8_t d1, uint8_t d2, uint8_t d3) {
+    write(stream_, (uint32_t)tick);
+    write(stream_, (uint8_t)kind);
+    write(stream_, d1);
+    write(stream_, d2);
+    write(stream_, d3);
+  }
+
+  ByteWriter& stream_;
+  // Holds the fields that follow the tracks.
+  MidiFileResource mfr_;
+  TempoMapBuilder tempo_map_{ TICKS_PER_QN };
+  tick_t final_tick_{};
+  uint32_t last_track_final_tick_{};
+  size_t last_track_final_tick_pos_{};
+
+  uint16_t track_{};
+  std::string name_;
+  uint32_t num_events_{};
+  size_t unk_pos_{};
+  size_t count_pos_{};
+  TrackStringTable strings_;
+  // Text events of the track, in case it turns out to be the chords track.
+  std::vector<std::pair<tick_t, uint16_t>> texts_;
+};
+
+void MidiFileResource::ConvertMidi(ByteReader& midi, ByteWriter& stream) {
+  MidiConverter converter(stream);
+  MidiFile::Parse(midi, converter);
+  converter.Finish();
+}
+
+// Lint
+
+namespace {
+
+void AddIssue(std::vector<MidiFileResource::LintIssue>& issues, size_t offset, const char* format, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  issues.push_back({offset, message});
+}
+
+// Checks one 8-byte event record, reporting everything wrong with it.
+void LintRecord(const uint8_t* record, uint32_t prev_tick, size_t num_strings, size_t offset, std::vector<MidiFileResource::LintIssue>& issues) {
+  uint32_t tick;
+  memcpy(&tick, record, sizeof(tick));
+  if (tick < prev_tick)
+    AddIssue(issues, offset, "Event at tick %u follows one at tick %u", tick, prev_tick);
+  uint8_t d1 = record[5], d2 = record[6], d3 = record[7];
+  switch ((HmxEventType)record[4])
+  {
+    case HmxEventType::Midi:
+      switch ((EventType)(d1 & 0xF0))
+      {
+        case EventType::NoteOff:
+        case EventType::NoteOn:
+        case EventType::Controller:
+        case EventType::PitchBend: // the most significant 7 bits come first
+          if (d2 > 0x7F || d3 > 0x7F)
+            AddIssue(issues, offset, "Midi message 0x%02X has data bytes 0x%02X 0x%02X out of range", d1, d2, d3);
+          break;
+        case EventType::ProgramChange:
+        case EventType::ChannelPressure:
+          if (d2 > 0x7F)
+            AddIssue(issues, offset, "Midi message 0x%02X has data byte 0x%02X out of range", d1, d2);
+          break;
+        default:
+          AddIssue(issues, offset, "Invalid midi status 0x%02X", d1);
+      }
+      break;
+    case HmxEventType::Tempo:
+      if ((d1 << 16 | d3 << 8 | d2) == 0)
+        AddIssue(issues, offset, "Tempo of 0 microseconds per quarter note");
+      break;
+    case HmxEventType::TimeSignature:
+      if (d1 == 0 || d2 == 0 || (d2 & (d2 - 1)) != 0)
+        AddIssue(issues, offset, "Invalid time signature %u/%u", d1, d2);
+      break;
+    case HmxEventType::Meta: {
+      auto t = (MetaEventType)d1;
+      if (t < MetaEventType::Text || t > MetaEventType::CuePoint)
+        AddIssue(issues, offset, "Invalid text event type 0x%02X", d1);
+      uint16_t string_index = d2 | d3 << 8;
+      if (string_index >= num_strings)
+        AddIssue(issues, offset, "Text event string index %u out of range for %zu strings", string_index, num_strings);
+      break;
+    }
+    default:
+      AddIssue(issues, offset, "Unknown event kind %u", record[4]);
+  }
+}
+
+// True if none of the four records starting here has anything to report. With
+// SSE2, runs of in-order channel message and text records are checked four at a
+// time; anything else is left for LintRecord.
+bool RecordsClean(const uint8_t* records, uint32_t prev_tick, size_t num_strings) {
+#ifdef HAVE_SSE2
+  const __m128i low_byte = _mm_set1_epi32(0xFF);
+  const __m128i sign = _mm_set1_epi32(INT32_MIN);
+  __m128i lo = _mm_loadu_si128((const __m128i*)records);
+  __m128i hi = _mm_loadu_si128((const __m128i*)(records + 16));
+  lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+  hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+  __m128i tick = _mm_unpacklo_epi64(lo, hi);
+  __m128i fields = _mm_unpackhi_epi64(lo, hi);
+
+  // Each tick against the one before it, compared unsigned.
+  __m128i prev = _mm_or_si128(_mm_slli_si128(tick, 4), _mm_cvtsi32_si128((int)prev_tick));
+  __m128i backwards = _mm_cmpgt_epi32(_mm_xor_si128(prev, sign), _mm_xor_si128(tick, sign));
+
+  __m128i kind = _mm_and_si128(fields, low_byte);
+  __m128i d1 = _mm_and_si128(_mm_srli_epi32(fields, 8), low_byte);
+  // Channel messages other than key pressure, with both data bytes under 0x80.
+  __m128i type = _mm_and_si128(d1, _mm_set1_epi32(0xF0));
+  __m128i midi = _mm_andnot_si128(
+    _mm_cmpeq_epi32(type, _mm_set1_epi32(0xA0)),
+    _mm_and_si128(
+      _mm_and_si128(_mm_cmpeq_epi32(kind, _mm_set1_epi32((int)HmxEventType::Midi)), _mm_cmpgt_epi32(d1, _mm_set1_epi32(0x7F))),
+      _mm_and_si128(_mm_cmplt_epi32(d1, _mm_set1_epi32(0xF0)), _mm_cmpeq_epi32(_mm_and_si128(fields, _mm_set1_epi32(0x80800000)), _mm_setzero_si128()))));
+  // Text records whose type and string index are in range.
+  __m128i string_index = _mm_srli_epi32(fields, 16);
+  __m128i text = _mm_and_si128(
+    _mm_and_si128(_mm_cmpeq_epi32(kind, _mm_set1_epi32((int)HmxEventType::Meta)), _mm_cmpgt_epi32(d1, _mm_setzero_si128())),
+    _mm_and_si128(_mm_cmplt_epi32(d1, _mm_set1_epi32((int)MetaEventType::CuePoint + 1)),
+      _mm_cmplt_epi32(string_index, _mm_set1_epi32((int)std::min<size_t>(num_strings, 0x10000)))));
+  return _mm_movemask_epi8(_mm_andnot_si128(backwards, _mm_or_si128(midi, text))) == 0xFFFF;
+#else
+  return false;
+#endif
+}
+
+// Checks the event records of a track, handing blocks that aren't clean to LintRecord.
+void LintRecords(const uint8_t* records, uint32_t count, size_t num_strings, size_t offset, std::vector<MidiFileResource::LintIssue>& issues) {
+  uint32_t prev_tick = 0;
+  auto tick_at = [&](size_t i) { uint32_t tick; memcpy(&tick, records + i * 8, sizeof(tick)); return tick; };
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    if (!RecordsClean(records + i * 8, prev_tick, num_strings)) {
+      for (size_t j = i; j < i + 4; j++) {
+        LintRecord(records + j * 8, prev_tick, num_strings, offset + j * 8, issues);
+        prev_tick = tick_at(j);
+      }
+    }
+    prev_tick = tick_at(i + 3);
+  }
+  for (; i < count; i++) {
+    LintRecord(records + i * 8, prev_tick, num_strings, offset + i * 8, issues);
+    prev_tick = tick_at(i);
+  }
+}
+
+}
+
+std::vector<MidiFileResource::LintIssue> MidiFileResource::Lint(ByteReader& stream) {
+  std::vector<LintIssue> issues;
+  MidiFileResourceView view;
+  try {
+    view = MidiFileResourceView::Open(stream);
+  } catch (const std::exception& ex) {
+    // The layout is broken, so nothing after this point can be found.
+    AddIssue(issues, stream.Tell(), "%s", ex.what());
+    return issues;
+  }
+  if (!stream.Eof())
+    AddIssue(issues, stream.Tell(), "%zu unexpected bytes after the track names", stream.Remaining());
+  auto offset_of = [&](const void* p) { return (size_t)((const uint8_t*)p - stream.data()); };
+
+  size_t t = 0;
+  uint32_t last_track_end = 0;
+  for (const auto& track : view.tracks()) {
+    auto records = (const uint8_t*)track.records.data();
+    LintRecords(records, (uint32_t)track.records.size(), track.strings.size(), offset_of(records), issues);
+    // Out of order ticks have been reported, so the last record is taken to be the furthest.
+    last_track_end = track.records.empty() ? 0 : track.records.back().tick;
+    if (last_track_end > view.final_tick())
+      AddIssue(issues, offset_of(&track.records.back()), "Track %zu has an event at tick %u after the final tick %u", t, last_track_end, view.final_tick());
+    t++;
+  }
+  if (last_track_end > view.last_track_final_tick())
+    AddIssue(issues, 4, "Last track final tick %u is before the last track's event at tick %u", view.last_track_final_tick(), last_track_end);
+  if (view.track_names().size() != view.tracks().size())
+    AddIssue(issues, offset_of(view.track_names().data()) - sizeof(uint32_t), "%u track names for %u tracks", view.track_names().size(), view.tracks().size());
+
+  const auto& trailer = view.trailer();
+  if (trailer.final_tick_minus_one != view.final_tick() - 1)
+    AddIssue(issues, offset_of(&trailer.final_tick_minus_one), "Final tick minus one is %u but the final tick is %u", trailer.final_tick_minus_one, view.final_tick());
+
+  // Measures aren't checked: which rule the game counts them by hasn't been confirmed,
+  // and resources made by other tools may not follow this one's.
+  auto sigs = view.time_sigs();
+  for (size_t i = 0; i < sigs.size(); i++) {
+    const auto& sig = sigs[i];
+    if (i > 0 && sig.tick < sigs[i - 1].tick)
+      AddIssue(issues, offset_of(&sig), "Time signature at tick %u follows one at tick %u", sig.tick, sigs[i - 1].tick);
+    if (sig.numerator <= 0 || sig.numerator > UINT8_MAX || sig.denominator <= 0 || sig.denominator > UINT8_MAX || (sig.denominator & (sig.denominator - 1)) != 0)
+      AddIssue(issues, offset_of(&sig), "Invalid time signature %d/%d", sig.numerator, sig.denominator);
+  }
+
+  auto tempos = view.tempos();
+  for (size_t i = 0; i < tempos.size(); i++) {
+    const auto& tempo = tempos[i];
+    if (tempo.tempo <= 0)
+      AddIssue(issues, offset_of(&tempo), "Tempo at tick %u is %d microseconds per quarter note", tempo.start_ticks, tempo.tempo);
+    if (i > 0 && (tempo.start_ticks < tempos[i - 1].start_ticks || tempo.start_millis < tempos[i - 1].start_millis))
+      AddIssue(issues, offset_of(&tempo), "Tempo at tick %u follows one at tick %u", tempo.start_ticks, tempos[i - 1].start_ticks);
+  }
+  auto beats = view.beats();
+  for (size_t i = 1; i < beats.size(); i++) {
+    if (beats[i].tick <= beats[i - 1].tick)
+      AddIssue(issues, offset_of(&beats[i]), "Beat at tick %u follows one at tick %u", beats[i].tick, beats[i - 1].tick);
+  }
+
+  // Each chord lasts until the tick before the next one starts, and the last one has no end.
+  const auto& chords = view.chords();
+  std::optional<MidiFileResourceView::Chord> prev;
+  size_t i = 0;
+  for (auto it = chords.begin(); it != chords.end(); ++it, i++) {
+    const auto& chord = *it;
+    auto offset = offset_of(it.position());
+    int name_length = (int)chord.name.size();
+    bool last = i + 1 == chords.size();
+    if (chord.start > view.final_tick())
+      AddIssue(issues, offset, "Chord %.*s starts at tick %u after the final tick %u", name_length, chord.name.data(), chord.start, view.final_tick());
+    if (chord.end == UINT32_MAX ? !last : (uint64_t)chord.end + 1 < chord.start || chord.end > view.final_tick())
+      AddIssue(issues, offset, "Chord %.*s starting at tick %u has an invalid end tick %u", name_length, chord.name.data(), chord.start, chord.end);
+    if (prev && prev->end != UINT32_MAX && chord.start <= prev->end)
+      AddIssue(issues, offset, "Chord %.*s at tick %u overlaps the chord before it, which ends at tick %u", name_length, chord.name.data(), chord.start, prev->end);
+    prev = chord;
+  }
+  return issues;
+}
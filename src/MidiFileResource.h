@@ -3,7 +3,9 @@
 #include <stdint.h>
 
 #include <array>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "SMF.h"
@@ -13,10 +15,33 @@ typedef uint32_t tick_t;
 class MidiFileResource
 {
 public:
-  static MidiFileResource Deserialize(std::istream& stream);
+  // With compact set, tracks are read into compact_tracks_ and tracks_ is left empty.
+  // Only the track events the filter selects are kept.
+  static MidiFileResource Deserialize(ByteReader& stream, bool compact = false, const EventFilter& filter = {});
   static MidiFileResource FromMidi(MidiFile& midi);
-  void Serialize(std::ostream& stream) const;
+  // Converts a standard midi file straight to a serialized MidiFileResource in one
+  // pass, without building either in memory. Writes the same bytes as FromMidi
+  // followed by Serialize. Throws an exception if there's an issue.
+  static void ConvertMidi(ByteReader& midi, ByteWriter& stream);
+  void Serialize(ByteWriter& stream) const;
   MidiFile ExtractMidi() const;
+  // Converts a serialized MidiFileResource straight to a standard midi file, one
+  // track at a time. Writes the same bytes as Deserialize, ExtractMidi and
+  // MidiFile::WriteMidi. Throws an exception if there's an issue.
+  static void ExtractMidi(ByteReader& stream, ByteWriter& midi);
+
+  struct LintIssue
+  {
+    // Byte offset into the stream of the offending record or field.
+    size_t offset;
+    std::string message;
+  };
+  // Checks a whole serialized MidiFileResource in one pass without decoding it and
+  // returns every problem found: bad event records, final ticks, time signatures,
+  // tempos, beats and chords that don't agree with each other. Measure counts
+  // aren't checked. If the layout itself is broken, the only issue is where
+  // reading stopped.
+  static std::vector<LintIssue> Lint(ByteReader& stream);
 
   struct Tempo
   {
@@ -47,10 +72,17 @@ public:
     int32_t unk;
     MidiTrack track;
   };
+  struct CompactTrackWrapper
+  {
+    int32_t unk;
+    CompactTrack track;
+  };
 
   int32_t magic_{ 2 };
   uint32_t last_track_final_tick_{};
   std::vector<TrackWrapper> tracks_;
+  // Serialize writes these instead of tracks_ when there are any.
+  std::vector<CompactTrackWrapper> compact_tracks_;
 
   int fuser_revision_{};
   uint32_t final_tick_{};
@@ -65,4 +97,57 @@ public:
   int32_t fuser_revision_2_{};
   std::vector<Chord> chords_;
   std::vector<std::string> track_names_;
+
+private:
+  // Fills in the tempos, time signatures, measures and the other fields that
+  // follow the tracks, once the tracks and chords have been added.
+  void FinishFromMidi(const std::vector<TimeSigTempoEvent>& markers, const TempoMap& tempo_map, tick_t final_tick);
+  // Writes everything that follows the tracks.
+  void SerializeTrailer(ByteWriter& stream) const;
+  // Reads everything that follows the tracks.
+  void DeserializeTrailer(ByteReader& stream);
+
+  friend class MidiConverter;
+  friend class LazyMidiFileResource;
+};
+
+// A MidiFileResource whose tracks are only decoded when they're asked for.
+// Opening it steps over the tracks to record where each one starts and reads
+// everything that follows them. The stream's data must outlive it.
+class LazyMidiFileResource {
+public:
+  // Indexes the tracks and reads the tempos, time signatures, chords, track names
+  // and the rest of the fields after the tracks. Throws an exception if there's an issue.
+  static LazyMidiFileResource Open(ByteReader& stream);
+
+  size_t num_tracks() const { return tracks_.size(); }
+  uint32_t num_events(size_t index) const { return tracks_[index].num_events; }
+  // Everything but the tracks, which are left empty.
+  const MidiFileResource& resource() const { return resource_; }
+  const std::vector<std::string>& track_names() const { return resource_.track_names_; }
+  const std::vector<MidiFileResource::Chord>& chords() const { return resource_.chords_; }
+
+  // Decodes the track if it hasn't been already. Like Deserialize, the first
+  // track ends at the final tick.
+  const MidiFileResource::TrackWrapper& GetTrack(size_t index);
+  // Returns the track with the given name, or nullptr if there isn't one.
+  const MidiFileResource::TrackWrapper* GetTrackByName(const std::string& name);
+  // Decodes every remaining track and builds a full MidiFileResource.
+  MidiFileResource ToMidiFileResource();
+
+private:
+  struct Track {
+    size_t offset;
+    uint32_t num_events;
+    std::optional<MidiFileResource::TrackWrapper> track;
+  };
+  LazyMidiFileResource(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  const uint8_t* data_;
+  size_t size_;
+  MidiFileResource resource_;
+  std::vector<Track> tracks_;
+  std::unordered_map<std::string, size_t> names_;
+
+  friend class MidiFileResource;
 };
\ No newline at end of file
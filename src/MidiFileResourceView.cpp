@@ -0,0 +1,75 @@
+#include "MidiFileResourceView.h"
+
+static_assert(sizeof(MidiFileResourceView::Record) == 8, "Record must match its on-disk layout");
+static_assert(sizeof(MidiFileResourceView::Tempo) == 12, "Tempo must match its on-disk layout");
+static_assert(sizeof(MidiFileResourceView::TimeSig) == 12, "TimeSig must match its on-disk layout");
+static_assert(sizeof(MidiFileResourceView::Beat) == 5, "Beat must match its on-disk layout");
+static_assert(sizeof(MidiFileResourceView::Trailer) == 48, "Trailer must match its on-disk layout");
+
+// Views a count-prefixed array of packed records in place.
+template<typename T>
+std::span<const T> ViewArray(ByteReader& stream) {
+  auto count = read<uint32_t>(stream);
+  if (count > stream.Remaining() / sizeof(T))
+    throw std::exception("Unexpected end of data");
+  return { (const T*)stream.Take(count * sizeof(T)), count };
+}
+
+// Views a count-prefixed list, reading each element once to find where it ends.
+template<typename List, typename ReadFunc>
+List ViewList(ByteReader& stream, ReadFunc read_func) {
+  auto count = read<uint32_t>(stream);
+  auto begin = stream.Current();
+  for (auto i = 0u; i < count; i++)
+    read_func(stream);
+  return List(begin, stream.Current(), count);
+}
+
+std::string_view MidiFileResourceView::ReadString(ByteReader& stream) {
+  auto length = read<uint32_t>(stream);
+  return { (const char*)stream.Take(length), length };
+}
+
+MidiFileResourceView::Chord MidiFileResourceView::ReadChord(ByteReader& stream) {
+  auto name = ReadString(stream);
+  auto start = read<uint32_t>(stream);
+  auto end = read<uint32_t>(stream);
+  return { name, start, end };
+}
+
+MidiFileResourceView::Track MidiFileResourceView::ReadTrack(ByteReader& stream) {
+  Track track;
+  read<uint8_t>(stream);
+  track.unk = read<int32_t>(stream);
+  track.records = ViewArray<Record>(stream);
+  track.strings = ViewList<StringList>(stream, ReadString);
+  return track;
+}
+
+MidiFileResourceView MidiFileResourceView::Open(ByteReader& stream) {
+  MidiFileResourceView view;
+  if (read<int32_t>(stream) != 2) {
+    throw std::exception("Only MidiFileResource rev 2 is supported");
+  }
+  view.last_track_final_tick_ = read<uint32_t>(stream);
+  view.tracks_ = ViewList<TrackList>(stream, ReadTrack);
+  auto finalTickOrRev = read<uint32_t>(stream);
+  if (finalTickOrRev == 0x56455223) { // '#REV'
+    view.fuser_revision_ = read<int32_t>(stream);
+    view.final_tick_ = read<uint32_t>(stream);
+  } else {
+    view.final_tick_ = finalTickOrRev;
+  }
+  view.trailer_ = (const Trailer*)stream.Take(sizeof(Trailer));
+  view.tempos_ = ViewArray<Tempo>(stream);
+  view.time_sigs_ = ViewArray<TimeSig>(stream);
+  view.beats_ = ViewArray<Beat>(stream);
+  read<int32_t>(stream); // unknown_zero
+  if (view.fuser_revision_ > 1)
+  {
+    read<int32_t>(stream); // fuser_revision_2
+    view.chords_ = ViewList<ChordList>(stream, ReadChord);
+  }
+  view.track_names_ = ViewList<StringList>(stream, ReadString);
+  return view;
+}
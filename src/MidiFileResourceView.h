@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <span>
+#include <string_view>
+
+#include "stream-helpers.h"
+
+// A read-only view over a serialized MidiFileResource, such as a MappedFile.
+// Nothing is copied or allocated: event records, tempos, time signatures and
+// beats are spans of their on-disk layouts, and strings point into the buffer.
+// Open checks the whole layout up front, so reading through the view afterwards
+// can't go out of bounds. The buffer must outlive the view and anything taken
+// from it.
+class MidiFileResourceView
+{
+public:
+  // The on-disk layouts, packed so they can be viewed in place at any offset.
+#pragma pack(push, 1)
+  struct Record
+  {
+    uint32_t tick;
+    uint8_t kind;
+    uint8_t data[3];
+  };
+  struct Tempo
+  {
+    float start_millis;
+    uint32_t start_ticks;
+    int32_t tempo;
+  };
+  struct TimeSig
+  {
+    int32_t measure;
+    uint32_t tick;
+    int16_t numerator;
+    int16_t denominator;
+  };
+  struct Beat
+  {
+    uint32_t tick;
+    uint8_t downbeat;
+  };
+  // The fixed-size fields between the final tick and the tempos.
+  struct Trailer
+  {
+    uint32_t measures;
+    uint32_t unknown_ints[6];
+    uint32_t final_tick_minus_one;
+    float unknown_floats[4];
+  };
+#pragma pack(pop)
+
+  struct Chord
+  {
+    std::string_view name;
+    uint32_t start;
+    uint32_t end;
+  };
+
+  // Variable-length elements laid end to end, read one at a time as they're walked.
+  template<typename T, T (*Read)(ByteReader&)>
+  class List
+  {
+  public:
+    class iterator
+    {
+    public:
+      iterator(const uint8_t* pos, const uint8_t* end) : pos_(pos), end_(end) { Load(); }
+      const T& operator*() const { return value_; }
+      const T* operator->() const { return &value_; }
+      // Where the current element starts in the buffer.
+      const uint8_t* position() const { return pos_; }
+      iterator& operator++() { pos_ = next_; Load(); return *this; }
+      bool operator==(const iterator& that) const { return pos_ == that.pos_; }
+      bool operator!=(const iterator& that) const { return pos_ != that.pos_; }
+
+    private:
+      void Load() {
+        if (pos_ == end_)
+          return;
+        ByteReader reader(pos_, end_ - pos_);
+        value_ = Read(reader);
+        next_ = pos_ + reader.Tell();
+      }
+
+      const uint8_t* pos_;
+      const uint8_t* end_;
+      const uint8_t* next_{};
+      T value_{};
+    };
+
+    List() = default;
+    List(const uint8_t* begin, const uint8_t* end, uint32_t count) : begin_(begin), end_(end), count_(count) {}
+
+    // Where the first element starts in the buffer.
+    const uint8_t* data() const { return begin_; }
+    uint32_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    iterator begin() const { return iterator(begin_, end_); }
+    iterator end() const { return iterator(end_, end_); }
+    // Walks the list up to the element, so iterate instead when reading more than one.
+    T operator[](size_t index) const {
+      auto it = begin();
+      while (index--)
+        ++it;
+      return *it;
+    }
+
+  private:
+    const uint8_t* begin_{};
+    const uint8_t* end_{};
+    uint32_t count_{};
+  };
+
+  static std::string_view ReadString(ByteReader& stream);
+  static Chord ReadChord(ByteReader& stream);
+  using StringList = List<std::string_view, ReadString>;
+  using ChordList = List<Chord, ReadChord>;
+
+  struct Track
+  {
+    int32_t unk;
+    std::span<const Record> records;
+    // The strings that text and track name records refer to by index.
+    StringList strings;
+  };
+  static Track ReadTrack(ByteReader& stream);
+  using TrackList = List<Track, ReadTrack>;
+
+  // Checks the layout and finds each section. Throws an exception if there's an issue.
+  static MidiFileResourceView Open(ByteReader& stream);
+
+  uint32_t last_track_final_tick() const { return last_track_final_tick_; }
+  const TrackList& tracks() const { return tracks_; }
+  int fuser_revision() const { return fuser_revision_; }
+  uint32_t final_tick() const { return final_tick_; }
+  const Trailer& trailer() const { return *trailer_; }
+  uint32_t measures() const { return trailer_->measures; }
+  std::span<const Tempo> tempos() const { return tempos_; }
+  std::span<const TimeSig> time_sigs() const { return time_sigs_; }
+  std::span<const Beat> beats() const { return beats_; }
+  const ChordList& chords() const { return chords_; }
+  const StringList& track_names() const { return track_names_; }
+
+private:
+  uint32_t last_track_final_tick_{};
+  TrackList tracks_;
+  int fuser_revision_{};
+  uint32_t final_tick_{};
+  const Trailer* trailer_{};
+  std::span<const Tempo> tempos_;
+  std::span<const TimeSig> time_sigs_;
+  std::span<const Beat> beats_;
+  ChordList chords_;
+  StringList track_names_;
+};
@@ -0,0 +1,138 @@
+#include "NoteSpans.h"
+
+#include <algorithm>
+
+#include "SMF.h"
+
+namespace {
+
+// Tracks the sounding notes of each channel and key as a FIFO linked through
+// the spans being built, so pairing doesn't allocate beyond the output.
+class NotePairer {
+public:
+  NotePairer() {
+    std::fill(std::begin(head_), std::end(head_), -1);
+    std::fill(std::begin(tail_), std::end(tail_), -1);
+  }
+
+  void NoteOn(int64_t tick, uint8_t channel, uint8_t key, uint8_t velocity) {
+    int32_t index = (int32_t)spans_.size();
+    spans_.push_back(NoteSpan{tick, -1, channel, key, velocity});
+    next_.push_back(-1);
+    auto slot = Slot(channel, key);
+    if (tail_[slot] >= 0)
+      next_[tail_[slot]] = index;
+    else
+      head_[slot] = index;
+    tail_[slot] = index;
+  }
+
+  void NoteOff(int64_t tick, uint8_t channel, uint8_t key) {
+    auto slot = Slot(channel, key);
+    auto index = head_[slot];
+    if (index < 0)
+      return;
+    spans_[index].end = tick;
+    head_[slot] = next_[index];
+    if (head_[slot] < 0)
+      tail_[slot] = -1;
+  }
+
+  // Ends any notes still sounding at the end of the track.
+  std::vector<NoteSpan> Finish(int64_t total_ticks) {
+    for (auto& span : spans_) {
+      if (span.end < 0)
+        span.end = std::max(span.start, total_ticks);
+    }
+    return std::move(spans_);
+  }
+
+  // Handles a channel message, ignoring anything that isn't a note.
+  void Message(int64_t tick, uint8_t status, uint8_t key, uint8_t velocity) {
+    auto type = (EventType)(status & 0xF0);
+    if (type == EventType::NoteOn && velocity != 0)
+      NoteOn(tick, status & 0xF, key, velocity);
+    else if (type == EventType::NoteOn || type == EventType::NoteOff)
+      NoteOff(tick, status & 0xF, key);
+  }
+
+private:
+  static size_t Slot(uint8_t channel, uint8_t key) { return (size_t)(channel & 0xF) << 7 | (key & 0x7F); }
+
+  std::vector<NoteSpan> spans_;
+  // The next note sounding on the same channel and key, for each span.
+  std::vector<int32_t> next_;
+  // Oldest and newest sounding note for each channel and key.
+  int32_t head_[16 * 128];
+  int32_t tail_[16 * 128];
+};
+
+}
+
+std::vector<NoteSpan> PairNotes(const MidiTrack& track) {
+  NotePairer pairer;
+  int64_t tick = 0;
+  for (const auto& event : track.events) {
+    tick += event.delta_time;
+    if (event.type != EventType::NoteOn && event.type != EventType::NoteOff)
+      continue;
+    const auto& midi_event = std::get<MidiEvent>(event.inner_event);
+    pairer.Message(tick, (uint8_t)event.type | midi_event.channel, midi_event.note.key, midi_event.note.velocity);
+  }
+  return pairer.Finish(track.total_ticks);
+}
+
+std::vector<NoteSpan> PairNotes(const CompactTrack& track) {
+  NotePairer pairer;
+  for (size_t i = 0; i < track.size(); i++) {
+    auto status = track.status(i);
+    if (IsChannelStatus(status))
+      pairer.Message(track.ticks[i], status, track.data1(i), track.data2(i));
+  }
+  return pairer.Finish(track.total_ticks);
+}
+
+// Zero-length notes are treated as one tick long so they can be found.
+static int64_t SoundingEnd(const NoteSpan& span) {
+  return std::max(span.end, span.start + 1);
+}
+
+NoteIndex::NoteIndex(std::vector<NoteSpan> spans) : spans_(std::move(spans)) {
+  auto by_start = [](const NoteSpan& a, const NoteSpan& b) { return a.start < b.start; };
+  if (!std::is_sorted(spans_.begin(), spans_.end(), by_start))
+    std::stable_sort(spans_.begin(), spans_.end(), by_start);
+  max_end_.resize(spans_.size());
+  Build(0, spans_.size());
+}
+
+int64_t NoteIndex::Build(size_t begin, size_t end) {
+  if (begin >= end)
+    return INT64_MIN;
+  size_t mid = begin + (end - begin) / 2;
+  int64_t max_end = std::max({ SoundingEnd(spans_[mid]), Build(begin, mid), Build(mid + 1, end) });
+  max_end_[mid] = max_end;
+  return max_end;
+}
+
+void NoteIndex::FindSounding(int64_t start, int64_t end, std::vector<const NoteSpan*>& out) const {
+  out.clear();
+  if (start >= end)
+    return;
+  // Only notes that start before the end of the range can sound in it.
+  auto limit = std::lower_bound(spans_.begin(), spans_.end(), end,
+    [](const NoteSpan& s, int64_t t) { return s.start < t; }) - spans_.begin();
+  Find(0, spans_.size(), (size_t)limit, start, out);
+}
+
+void NoteIndex::Find(size_t begin, size_t end, size_t limit, int64_t start, std::vector<const NoteSpan*>& out) const {
+  if (begin >= end || begin >= limit)
+    return;
+  size_t mid = begin + (end - begin) / 2;
+  // Nothing in this subrange is still sounding at the start of the range.
+  if (max_end_[mid] <= start)
+    return;
+  Find(begin, mid, limit, start, out);
+  if (mid < limit && SoundingEnd(spans_[mid]) > start)
+    out.push_back(&spans_[mid]);
+  Find(mid + 1, end, limit, start, out);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+struct CompactTrack;
+struct MidiTrack;
+
+// A note from its note-on to its matching note-off.
+struct NoteSpan {
+  // The MIDI tick of the note-on.
+  int64_t start;
+  // The MIDI tick of the note-off, or the end of the track if the note is never released.
+  int64_t end;
+  uint8_t channel;
+  uint8_t key;
+  uint8_t velocity;
+};
+
+// Pairs the note-ons and note-offs of a track in one pass and returns its notes
+// in note-on order. A note-on with velocity 0 counts as a note-off. When the same
+// key is struck again before it's released, each note-off ends the oldest
+// sounding note on that channel and key. Note-offs with nothing to end are ignored.
+std::vector<NoteSpan> PairNotes(const MidiTrack& track);
+std::vector<NoteSpan> PairNotes(const CompactTrack& track);
+
+// Interval index over note spans for finding the notes sounding in a tick range.
+// The spans are kept sorted by start tick, with an implicit balanced tree over
+// them that records the latest end in each subtree.
+class NoteIndex {
+public:
+  explicit NoteIndex(std::vector<NoteSpan> spans);
+
+  // Fills out with the notes sounding anywhere in [start, end), in start order.
+  // A note sounds over [note.start, note.end); zero-length notes sound at their start.
+  void FindSounding(int64_t start, int64_t end, std::vector<const NoteSpan*>& out) const;
+  void FindSoundingAt(int64_t tick, std::vector<const NoteSpan*>& out) const {
+    FindSounding(tick, tick + 1, out);
+  }
+
+  const std::vector<NoteSpan>& spans() const { return spans_; }
+
+private:
+  int64_t Build(size_t begin, size_t end);
+  void Find(size_t begin, size_t end, size_t limit, int64_t start, std::vector<const NoteSpan*>& out) const;
+
+  std::vector<NoteSpan> spans_;
+  // For the node at the middle of each subrange, the latest end in that subrange.
+  std::vector<int64_t> max_end_;
+};
@@ -0,0 +1,36 @@
+#include "PayloadArena.h"
+
+#include <string.h>
+
+#include <exception>
+
+uint32_t PayloadArena::Store(const uint8_t* data, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return StoreLocked(data, length);
+}
+
+uint32_t PayloadArena::Intern(const uint8_t* data, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = interned_.find(std::string_view((const char*)data, length));
+  if (it != interned_.end())
+    return it->second;
+  auto handle = StoreLocked(data, length);
+  interned_.emplace(std::string_view((const char*)Data(handle), length), handle);
+  return handle;
+}
+
+uint32_t PayloadArena::StoreLocked(const uint8_t* data, size_t length) {
+  if (block_used_ == BLOCK_SIZE || length > BLOCK_SIZE - block_used_) {
+    // Payloads bigger than a block get a block of their own, which is left full.
+    if (blocks_.size() >= (1u << (32 - BLOCK_BITS)))
+      throw std::exception("Payload arena is full");
+    blocks_.emplace_back(new uint8_t[length > BLOCK_SIZE ? length : BLOCK_SIZE]);
+    block_used_ = 0;
+  }
+  uint32_t handle = (uint32_t)((blocks_.size() - 1) << BLOCK_BITS | block_used_);
+  if (length > 0)
+    memcpy(blocks_.back().get() + block_used_, data, length);
+  block_used_ = length > BLOCK_SIZE ? BLOCK_SIZE : block_used_ + length;
+  bytes_used_ += length;
+  return handle;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Owns the meta and sysex payloads of a file's compact tracks. Bytes go into
+// fixed-size blocks that never move and are addressed by 32-bit handles, so
+// the whole file's payloads are freed with a handful of deallocations.
+// Interned payloads are stored once no matter how often they repeat.
+// Safe to fill from several threads at once, but not to read while filling.
+class PayloadArena {
+public:
+  // Copies the bytes into the arena and returns their handle.
+  uint32_t Store(const uint8_t* data, size_t length);
+  // Same as Store, but returns the existing handle if the same bytes were interned before.
+  uint32_t Intern(const uint8_t* data, size_t length);
+
+  const uint8_t* Data(uint32_t handle) const {
+    return blocks_[handle >> BLOCK_BITS].get() + (handle & (BLOCK_SIZE - 1));
+  }
+  // Total bytes stored, not counting block slack.
+  size_t bytes_used() const { return bytes_used_; }
+
+private:
+  static constexpr uint32_t BLOCK_BITS = 16;
+  static constexpr size_t BLOCK_SIZE = 1 << BLOCK_BITS;
+  uint32_t StoreLocked(const uint8_t* data, size_t length);
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+  // Bytes used in the last block. Starts full so the first store allocates one.
+  size_t block_used_{ BLOCK_SIZE };
+  size_t bytes_used_{ 0 };
+  std::unordered_map<std::string_view, uint32_t> interned_;
+};
@@ -1,7 +1,8 @@
+#include <algorithm>
 #include <array>
 #include <sstream>
-#include <map>
 
+#include "parallel-helpers.h"
 #include "stream-helpers.h"
 #include "SMF.h"
 
@@ -9,66 +10,64 @@ constexpr int MThd = 0x4D546864;
 constexpr int MTrk = 0x4D54726B;
 constexpr int HEADER_SIZE = 6;
 
-TrackEvent ReadEvent(std::istream& stream, uint8_t& running_status) {
-  auto deltaTime = read_mb(stream);
-  auto status = (uint8_t)stream.peek();
-  // set this to true if we expected to use running status but a status byte was provided anyway.
-  bool f_status = false;
+// An event exactly as it appears in the track, before it's turned into a TrackEvent.
+struct RawEvent {
+  uint32_t delta_time;
+  // Channel status byte, 0xFF for meta events or 0xF0/0xF7 for sysex.
+  uint8_t status;
+  // True if we expected to use running status but a status byte was provided anyway.
+  bool force_status;
+  // Channel message data bytes.
+  uint8_t data[2];
+  // Meta and sysex payload.
+  MetaEventType meta_type;
+  const uint8_t* payload;
+  uint32_t length;
+};
+
+RawEvent ReadRawEvent(ByteReader& stream, uint8_t& running_status) {
+  RawEvent event{};
+  event.delta_time = read_mb(stream);
+  auto status = stream.Peek();
   if (status < 0x80) // running status
   {
     status = running_status;
   }
   else
   {
-    stream.get();
-    f_status = (running_status == status);
+    stream.Get();
+    event.force_status = (running_status == status);
     if (status < 0xF0) // meta events do not trigger running status?
       running_status = status;
   }
-  uint8_t channel = status & 0xF;
-  uint8_t key, velocity, pressure, controller, value;
-  uint16_t bend;
-  EventType eventType = (EventType)(status & 0xF0);
-  switch (eventType)
+  event.status = status;
+  switch ((EventType)(status & 0xF0))
   {
     case EventType::NoteOff:
-      key = read_be<uint8_t>(stream);
-      velocity = read_be<uint8_t>(stream);
-      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, {key, velocity}}};
     case EventType::NoteOn:
-      key = read_be<uint8_t>(stream);
-      velocity = read_be<uint8_t>(stream);
-      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, {key, velocity}}};
     case EventType::NotePresure:
-      key = read_be<uint8_t>(stream);
-      pressure = read_be<uint8_t>(stream);
-      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, {key, pressure}}};
     case EventType::Controller:
-      controller = read_be<uint8_t>(stream);
-      value = read_be<uint8_t>(stream);
-      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, {controller, value}}};
-    case EventType::PitchBend:
-      bend = read_be<uint16_t>(stream);
-      // I think this should have worked without designated initializers. But MSVC complains!
-      return TrackEvent {deltaTime, eventType, MidiEvent{.force_status = f_status, .channel = channel, .bend = bend}};
+    case EventType::PitchBend: {
+      const uint8_t* bytes = stream.Take(2);
+      event.data[0] = bytes[0];
+      event.data[1] = bytes[1];
+      return event;
+    }
     case EventType::ProgramChange:
-      value = read_be<uint8_t>(stream);
-      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, value}};
     case EventType::ChannelPressure:
-      pressure = read_be<uint8_t>(stream);
-      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, pressure}};
+      event.data[0] = stream.Get();
+      return event;
   }
   if (status == 0xFF) // meta event
   {
-    auto type = read_be<MetaEventType>(stream);
-    auto length = read_mb(stream);
-    std::vector<uint8_t> tmp;
-    switch (type)
+    event.meta_type = read_be<MetaEventType>(stream);
+    event.length = read_mb(stream);
+    switch (event.meta_type)
     {
       case MetaEventType::SequenceNumber:
-        if (length != 2)
+        if (event.length != 2)
           throw std::exception("Sequence number events must have 2 bytes of data");
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, read_be<uint16_t>(stream))};
+        break;
       case MetaEventType::Text:
       case MetaEventType::CopyrightNotice:
       case MetaEventType::TrackName:
@@ -78,138 +77,358 @@ TrackEvent ReadEvent(std::istream& stream, uint8_t& running_status) {
       case MetaEventType::CuePoint:
       case MetaEventType::ProgramName:
       case MetaEventType::DeviceName:
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, read_str(stream, length))};
+      case MetaEventType::EndOfTrack:
+      case MetaEventType::SequencerSpecific:
+        break;
       case MetaEventType::ChannelPrefix:
       case MetaEventType::Port:
-        if (length != 1)
+        if (event.length != 1)
           throw std::exception("Channel prefix and port events must have 1 byte of data");
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, read_be<uint8_t>(stream))};
-      case MetaEventType::EndOfTrack:
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type)};
+        break;
       case MetaEventType::TempoEvent:
-        if (length != 3)
+        if (event.length != 3)
           throw std::exception("Tempo events must have 3 bytes of data");
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, read_i24_be(stream))};
+        break;
       case MetaEventType::SmpteOffset:
-        if (length != 5)
+        if (event.length != 5)
           throw std::exception("SMTPE Offset events must have 5 bytes of data");
-        tmp.resize(5);
-        stream.read((char*)tmp.data(), 5);
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, SmpteOffsetEvent{tmp[0], tmp[1], tmp[2], tmp[3], tmp[4]})};
+        break;
       case MetaEventType::TimeSignature:
-        if (length != 4)
+        if (event.length != 4)
           throw std::exception("Time Signature events must have 4 bytes of data");
-        tmp.resize(4);
-        stream.read((char*)tmp.data(), 4);
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, TimeSignatureEvent{tmp[0], tmp[1], tmp[2], tmp[3]})};
+        break;
       case MetaEventType::KeySignature:
-        if (length != 2)
+        if (event.length != 2)
           throw std::exception("Key Signature events must have 2 bytes of data");
-        tmp.resize(2);
-        stream.read((char*)tmp.data(), 2);
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, KeySignatureEvent{tmp[0], tmp[1]})};
-      case MetaEventType::SequencerSpecific:
-        tmp.resize(length);
-        stream.read((char*)tmp.data(), length);
-        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, tmp)};
-      default: { // unknown meta event, just skip past it.
+        break;
+      default: {
         std::ostringstream ss;
-        ss << "Unknown meta event type " << std::hex << (int)type << " at 0x" << stream.tellg();
+        ss << "Unknown meta event type " << std::hex << (int)event.meta_type << " at 0x" << stream.Tell();
         throw std::exception(ss.str().c_str());
       } break;
     }
   }
   else // sysex
   {
-    auto length = read_mb(stream);
-    std::vector<uint8_t> data;
-    if (status == 0xF0) // should prefix Sysex with F0 (start-of-exclusive)
+    event.length = read_mb(stream);
+  }
+  event.payload = stream.Take(event.length);
+  return event;
+}
+
+TrackEvent MakeTrackEvent(const RawEvent& raw) {
+  auto deltaTime = raw.delta_time;
+  bool f_status = raw.force_status;
+  uint8_t channel = raw.status & 0xF;
+  EventType eventType = (EventType)(raw.status & 0xF0);
+  const uint8_t* tmp = raw.payload;
+  switch (eventType)
+  {
+    case EventType::NoteOff:
+    case EventType::NoteOn:
+    case EventType::NotePresure:
+    case EventType::Controller:
+      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, {raw.data[0], raw.data[1]}}};
+    case EventType::PitchBend:
+      // I think this should have worked without designated initializers. But MSVC complains!
+      return TrackEvent {deltaTime, eventType, MidiEvent{.force_status = f_status, .channel = channel, .bend = (uint16_t)(raw.data[0] << 8 | raw.data[1])}};
+    case EventType::ProgramChange:
+    case EventType::ChannelPressure:
+      return TrackEvent {deltaTime, eventType, MidiEvent{f_status, channel, raw.data[0]}};
+  }
+  if (raw.status == 0xFF) // meta event
+  {
+    auto type = raw.meta_type;
+    switch (type)
     {
-      data.resize(length + 1);
-      data[0] = 0xF0;
-      stream.read((char*)&data[1], length);
+      case MetaEventType::SequenceNumber:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, (uint16_t)(tmp[0] << 8 | tmp[1]))};
+      case MetaEventType::ChannelPrefix:
+      case MetaEventType::Port:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, tmp[0])};
+      case MetaEventType::EndOfTrack:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type)};
+      case MetaEventType::TempoEvent:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, (uint32_t)(tmp[0] << 16 | tmp[1] << 8 | tmp[2]))};
+      case MetaEventType::SmpteOffset:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, SmpteOffsetEvent{tmp[0], tmp[1], tmp[2], tmp[3], tmp[4]})};
+      case MetaEventType::TimeSignature:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, TimeSignatureEvent{tmp[0], tmp[1], tmp[2], tmp[3]})};
+      case MetaEventType::KeySignature:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, KeySignatureEvent{tmp[0], tmp[1]})};
+      case MetaEventType::SequencerSpecific:
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, std::vector<uint8_t>(tmp, tmp + raw.length))};
+      default: // text events; ReadRawEvent has rejected everything else
+        return TrackEvent{deltaTime, EventType::Meta, MetaEvent(type, std::string((const char*)tmp, raw.length))};
     }
-    else
+  }
+  else // sysex
+  {
+    std::vector<uint8_t> data;
+    if (raw.status == 0xF0) // should prefix Sysex with F0 (start-of-exclusive)
     {
-      data.resize(length);
-      stream.read((char*)data.data(), length);
+      data.reserve(raw.length + 1);
+      data.push_back(0xF0);
     }
+    data.insert(data.end(), tmp, tmp + raw.length);
     return TrackEvent{deltaTime, EventType::Sysex, SysexEvent{data}};
   }
 }
 
-MidiTrack ReadTrack(std::istream& stream) {
+// Checks the track header and returns the offset where the track ends.
+size_t ReadTrackHeader(ByteReader& stream) {
   if (read_be<int>(stream) != MTrk)
     throw std::exception("MIDI track not recognized.");
-  int64_t track_length = read_be<uint32_t>(stream);
+  uint32_t track_length = read_be<uint32_t>(stream);
+  return stream.Tell() + track_length;
+}
+
+MidiTrack ReadTrack(ByteReader& stream, const EventFilter& filter) {
+  auto track_end = ReadTrackHeader(stream);
   int64_t total_ticks = 0;
   std::string name;
   std::vector<TrackEvent> events;
   uint8_t running_status = 0;
-  while (track_length > 0)
+  // Delta time of the events skipped since the last kept one.
+  uint32_t skipped_ticks = 0;
+  while (stream.Tell() < track_end)
   {
-    auto pos = stream.tellg();
-    auto event = ReadEvent(stream, running_status);
-    if (event.type == EventType::Meta && std::get<MetaEvent>(event.inner_event).type == MetaEventType::TrackName)
-      name = std::get<std::string>(std::get<MetaEvent>(event.inner_event).event);
+    auto event = ReadRawEvent(stream, running_status);
     total_ticks += event.delta_time;
-    events.push_back(std::move(event));
-    track_length -= stream.tellg() - pos; // subtract message length from total track length
+    if (event.status == 0xFF && event.meta_type == MetaEventType::TrackName)
+      name.assign((const char*)event.payload, event.length);
+    if (!filter.Keeps(event.status, event.meta_type))
+    {
+      skipped_ticks += event.delta_time;
+      continue;
+    }
+    event.delta_time += skipped_ticks;
+    skipped_ticks = 0;
+    events.push_back(MakeTrackEvent(event));
   }
   return MidiTrack{name, total_ticks, events};
 }
 
-MidiFile MidiFile::ReadMidi(std::istream& stream) {
+CompactTrack ReadCompactTrack(ByteReader& stream, const EventFilter& filter, const std::shared_ptr<PayloadArena>& arena) {
+  auto track_end = ReadTrackHeader(stream);
+  CompactTrack track;
+  track.arena = arena;
+  // Channel messages take at least 2 bytes, so this is a safe upper bound.
+  track.ticks.reserve((track_end - stream.Tell()) / 2);
+  track.messages.reserve((track_end - stream.Tell()) / 2);
+  // Text already interned by this track, keyed by its bytes in the input. Saves
+  // taking the shared arena's lock for every repeated lyric.
+  std::unordered_map<std::string_view, uint32_t> interned;
+  uint32_t tick = 0;
+  uint8_t running_status = 0;
+  while (stream.Tell() < track_end)
+  {
+    auto event = ReadRawEvent(stream, running_status);
+    tick += event.delta_time;
+    if (event.status == 0xFF && event.meta_type == MetaEventType::TrackName)
+      track.name.assign((const char*)event.payload, event.length);
+    if (!filter.Keeps(event.status, event.meta_type))
+      continue;
+    if (IsChannelStatus(event.status)) {
+      track.AddMidi(tick, event.status, event.data[0], event.data[1], event.force_status);
+    } else if (event.status == 0xFF && IsTextEvent(event.meta_type)) {
+      auto [it, inserted] = interned.try_emplace(std::string_view((const char*)event.payload, event.length));
+      if (inserted)
+        it->second = arena->Intern(event.payload, event.length);
+      track.AddPayload(tick, event.status, event.meta_type, it->second, event.length);
+    } else {
+      track.AddPayload(tick, event.status, event.meta_type, event.payload, event.length);
+    }
+  }
+  track.total_ticks = tick;
+  track.ticks.shrink_to_fit();
+  track.messages.shrink_to_fit();
+  return track;
+}
+
+// Reads the header chunk, leaving the stream at the first track.
+uint16_t ReadHeader(ByteReader& stream, MidiFormat& format, uint16_t& ticks_per_qn) {
   // "MThd" big-endian, header size always = 6
   if (read_be<int>(stream) != MThd || read_be<int>(stream) != HEADER_SIZE)
     throw std::exception("MIDI file did not begin with proper MIDI header.");
-  MidiFormat format = read_be<MidiFormat>(stream);
+  format = read_be<MidiFormat>(stream);
   if (format > MidiFormat::MultiTrack) {
     std::ostringstream ss;
     ss << "MIDI format " << (int)format << " is not supported by this library.";
     throw std::exception(ss.str().c_str());
   }
   auto num_tracks = read_be<uint16_t>(stream);
-  uint16_t ticks_per_qn = read_be<uint16_t>(stream);
+  ticks_per_qn = read_be<uint16_t>(stream);
   if ((ticks_per_qn & 0x8000) == 0x8000)
     throw std::exception("SMPTE delta time format is not supported by this library.");
+  return num_tracks;
+}
 
-  std::vector<MidiTrack> tracks;
-  for (int i = 0; i < num_tracks; i++)
+// Walks the track chunk headers without decoding any events, returning the
+// offset of each chunk and leaving the stream at the end of the last one.
+std::vector<size_t> FindTracks(ByteReader& stream, uint16_t num_tracks) {
+  std::vector<size_t> offsets(num_tracks);
+  for (auto& offset : offsets)
   {
-    tracks.push_back(ReadTrack(stream));
+    offset = stream.Tell();
+    auto track_end = ReadTrackHeader(stream);
+    stream.Skip(track_end - stream.Tell());
   }
+  return offsets;
+}
+
+// A reader over the whole file positioned at a track chunk, so error offsets stay file-relative.
+ByteReader TrackReader(const ByteReader& stream, size_t offset) {
+  ByteReader reader(stream.data(), stream.size());
+  reader.Seek(offset);
+  return reader;
+}
+
+MidiFile MidiFile::ReadMidi(ByteReader& stream) {
+  return ReadMidi(stream, EventFilter());
+}
+
+MidiFile MidiFile::ReadMidi(ByteReader& stream, const EventFilter& filter) {
+  MidiFormat format;
+  uint16_t ticks_per_qn;
+  auto num_tracks = ReadHeader(stream, format, ticks_per_qn);
+
+  auto offsets = FindTracks(stream, num_tracks);
+  std::vector<MidiTrack> tracks(num_tracks);
+  parallel_for(num_tracks, [&](size_t i) {
+    auto reader = TrackReader(stream, offsets[i]);
+    tracks[i] = ReadTrack(reader, filter);
+  });
   return MidiFile(format, tracks, ticks_per_qn);
 }
 
-void WriteEvent(std::ostream& stream, const TrackEvent& event, uint8_t& running_status) {
-  write_mb(stream, event.delta_time);
+CompactMidiFile CompactMidiFile::ReadMidi(ByteReader& stream, const EventFilter& filter) {
+  CompactMidiFile midi;
+  auto num_tracks = ReadHeader(stream, midi.format, midi.ticks_per_qn);
+  auto offsets = FindTracks(stream, num_tracks);
+  auto arena = std::make_shared<PayloadArena>();
+  midi.tracks.resize(num_tracks);
+  parallel_for(num_tracks, [&](size_t i) {
+    auto reader = TrackReader(stream, offsets[i]);
+    midi.tracks[i] = ReadCompactTrack(reader, filter, arena);
+  });
+  return midi;
+}
+
+// Scans the start of a track chunk for its name. Names are expected before
+// anything happens in the track, so this stops at the first non-zero delta.
+std::string PeekTrackName(ByteReader& stream) {
+  auto track_end = ReadTrackHeader(stream);
+  uint8_t running_status = 0;
+  while (stream.Tell() < track_end)
+  {
+    auto event = ReadRawEvent(stream, running_status);
+    if (event.delta_time != 0)
+      break;
+    if (event.status == 0xFF && event.meta_type == MetaEventType::TrackName)
+      return std::string((const char*)event.payload, event.length);
+  }
+  return "";
+}
+
+LazyMidiFile LazyMidiFile::Open(ByteReader& stream) {
+  LazyMidiFile midi(stream.data(), stream.size());
+  auto num_tracks = ReadHeader(stream, midi.format_, midi.ticks_per_qn_);
+  auto offsets = FindTracks(stream, num_tracks);
+  midi.chunks_.resize(num_tracks);
+  for (uint16_t i = 0; i < num_tracks; i++)
+  {
+    auto& chunk = midi.chunks_[i];
+    chunk.offset = offsets[i];
+    auto reader = TrackReader(stream, chunk.offset);
+    chunk.name = PeekTrackName(reader);
+    midi.names_.emplace(chunk.name, i);
+  }
+  return midi;
+}
+
+const MidiTrack& LazyMidiFile::GetTrack(size_t index) {
+  auto& chunk = chunks_.at(index);
+  if (!chunk.track)
+  {
+    auto reader = TrackReader(ByteReader(data_, size_), chunk.offset);
+    chunk.track = ReadTrack(reader, EventFilter());
+  }
+  return *chunk.track;
+}
+
+const MidiTrack* LazyMidiFile::GetTrackByName(const std::string& name) {
+  auto it = names_.find(name);
+  if (it == names_.end())
+    return nullptr;
+  return &GetTrack(it->second);
+}
+
+MidiFile LazyMidiFile::ToMidiFile() {
+  parallel_for(chunks_.size(), [&](size_t i) {
+    GetTrack(i);
+  });
+  std::vector<MidiTrack> tracks;
+  tracks.reserve(chunks_.size());
+  for (const auto& chunk : chunks_)
+    tracks.push_back(*chunk.track);
+  return MidiFile(format_, tracks, ticks_per_qn_);
+}
+
+void MidiFile::Parse(ByteReader& stream, MidiVisitor& visitor) {
+  MidiFormat format;
+  uint16_t ticks_per_qn;
+  auto num_tracks = ReadHeader(stream, format, ticks_per_qn);
+  visitor.Header(format, num_tracks, ticks_per_qn);
+  for (uint16_t i = 0; i < num_tracks; i++)
+  {
+    auto track_end = ReadTrackHeader(stream);
+    visitor.TrackBegin(i);
+    int64_t tick = 0;
+    uint8_t running_status = 0;
+    while (stream.Tell() < track_end)
+    {
+      auto event = ReadRawEvent(stream, running_status);
+      tick += event.delta_time;
+      if (IsChannelStatus(event.status))
+        visitor.ChannelMessage(tick, event.status, event.data[0], event.data[1]);
+      else if (event.status == 0xFF)
+        visitor.Meta(tick, event.meta_type, event.payload, event.length);
+      else
+        visitor.Sysex(tick, event.status, event.payload, event.length);
+    }
+    visitor.TrackEnd(i, tick);
+  }
+}
+
+// Writes everything but the delta time.
+void WriteEventBody(ByteWriter& stream, const TrackEvent& event, uint8_t& running_status) {
   if (event.type >= EventType::NoteOff && event.type <= EventType::PitchBend) {
     const auto& midi_event = std::get<MidiEvent>(event.inner_event);
     uint8_t status = midi_event.channel | (uint8_t)event.type;
     if(status != running_status || midi_event.force_status) {
-      stream.put((char)status);
+      stream.Put((char)status);
       running_status = status;
     }
     switch(event.type) {
       case EventType::NoteOff:
       case EventType::NoteOn:
-        stream.put((char)midi_event.note.key);
-        stream.put((char)midi_event.note.velocity);
+        stream.Put((char)midi_event.note.key);
+        stream.Put((char)midi_event.note.velocity);
         break;
       case EventType::NotePresure:
-        stream.put((char)midi_event.note.key);
-        stream.put((char)midi_event.note.pressure);
+        stream.Put((char)midi_event.note.key);
+        stream.Put((char)midi_event.note.pressure);
         break;
       case EventType::Controller:
-        stream.put((char)midi_event.controller.controller);
-        stream.put((char)midi_event.controller.value);
+        stream.Put((char)midi_event.controller.controller);
+        stream.Put((char)midi_event.controller.value);
         break;
       case EventType::ProgramChange:
-        stream.put((char)midi_event.program);
+        stream.Put((char)midi_event.program);
         break;
       case EventType::ChannelPressure:
-        stream.put((char)midi_event.pressure);
+        stream.Put((char)midi_event.pressure);
         break;
       case EventType::PitchBend:
         write_be(stream, midi_event.bend);
@@ -219,8 +438,8 @@ void WriteEvent(std::ostream& stream, const TrackEvent& event, uint8_t& running_
     // cancel running status
     //running_status = 0;
     const auto& meta_event = std::get<MetaEvent>(event.inner_event);
-    stream.put((char)0xFF);
-    stream.put((char)meta_event.type);
+    stream.Put((char)0xFF);
+    stream.Put((char)meta_event.type);
     switch(meta_event.type)
     {
       case MetaEventType::SequenceNumber:
@@ -238,12 +457,12 @@ void WriteEvent(std::ostream& stream, const TrackEvent& event, uint8_t& running_
       case MetaEventType::DeviceName: {
         const auto& text = std::get<std::string>(meta_event.event);
         write_mb(stream, text.size());
-        stream.write(text.c_str(), text.size());
+        stream.Write(text.data(), text.size());
       } break;
       case MetaEventType::ChannelPrefix:
       case MetaEventType::Port:
         write_mb(stream, 1);
-        stream.put((char)std::get<uint8_t>(meta_event.event));
+        stream.Put((char)std::get<uint8_t>(meta_event.event));
         break;
       case MetaEventType::EndOfTrack:
         write_mb(stream, 0);
@@ -256,55 +475,264 @@ void WriteEvent(std::ostream& stream, const TrackEvent& event, uint8_t& running_
         write_mb(stream, 5);
         const auto& x = std::get<SmpteOffsetEvent>(meta_event.event);
         std::array<uint8_t,5> data{ x.h, x.m, x.s, x.f, x.frame_hundredths };
-        stream.write((char*)data.data(), 5);
+        stream.Write(data.data(), 5);
       } break;
       case MetaEventType::TimeSignature: {
         write_mb(stream, 4);
         const auto& x = std::get<TimeSignatureEvent>(meta_event.event);
         std::array<uint8_t,4> data{ x.numerator, x.denominator, x.clocks_per_tick, x.thirtysecond_notes_per_24_clocks };
-        stream.write((char*)data.data(), 4);
+        stream.Write(data.data(), 4);
       } break;
       case MetaEventType::KeySignature: {
         write_mb(stream, 2);
         const auto& x = std::get<KeySignatureEvent>(meta_event.event);
-        stream.put((char)x.sharps);
-        stream.put((char)x.tonality);
+        stream.Put((char)x.sharps);
+        stream.Put((char)x.tonality);
       } break;
       case MetaEventType::SequencerSpecific: {
         const auto& x = std::get<std::vector<uint8_t>>(meta_event.event);
         write_mb(stream, x.size());
-        stream.write((char*)x.data(), x.size());
+        stream.Write(x.data(), x.size());
       } break;
     }
   } else {
     // cancel running status
     //running_status = 0;
     const auto& sysex = std::get<SysexEvent>(event.inner_event);
-    stream.put((char)0xF0);
+    stream.Put((char)0xF0);
     write_mb(stream, sysex.data.size());
-    stream.write((char*)sysex.data.data(), sysex.data.size());
+    stream.Write(sysex.data.data(), sysex.data.size());
   }
 }
 
-void MidiFile::WriteMidi(std::ostream& stream) {
+void WriteEvent(ByteWriter& stream, const TrackEvent& event, uint8_t& running_status) {
+  write_mb(stream, event.delta_time);
+  WriteEventBody(stream, event, running_status);
+}
+
+void WriteMidiHeader(ByteWriter& stream, MidiFormat format, uint16_t num_tracks, uint16_t ticks_per_qn) {
   write_be(stream, MThd);
   write_be(stream, HEADER_SIZE);
-  write_be<uint16_t>(stream, (uint16_t)format_);
-  write_be<uint16_t>(stream, (uint16_t)tracks_.size());
-  write_be<uint16_t>(stream, ticks_per_qn_);
-  for(const auto& t : tracks_) {
-    write_be(stream, MTrk);
-    std::ostringstream os;
+  write_be<uint16_t>(stream, (uint16_t)format);
+  write_be<uint16_t>(stream, num_tracks);
+  write_be<uint16_t>(stream, ticks_per_qn);
+}
+
+// Writes the track header with a placeholder length, returning where to patch it.
+size_t BeginMidiTrack(ByteWriter& stream) {
+  write_be(stream, MTrk);
+  auto length_pos = stream.Tell();
+  write_be<uint32_t>(stream, 0);
+  return length_pos;
+}
+
+void EndMidiTrack(ByteWriter& stream, size_t length_pos) {
+  patch_be<uint32_t>(stream, length_pos, (uint32_t)(stream.Tell() - length_pos - sizeof(uint32_t)));
+}
+
+void MidiFile::WriteMidi(ByteWriter& stream) {
+  WriteMidiHeader(stream, format_, (uint16_t)tracks_.size(), ticks_per_qn_);
+  parallel_write(stream, tracks_.size(), [&](ByteWriter& track_stream, size_t i) {
+    // Track length is patched in once the events are written.
+    auto length_pos = BeginMidiTrack(track_stream);
     uint8_t running_status = 0;
-    for(const auto& e : t.events) {
-      WriteEvent(os, e, running_status);
+    for(const auto& e : tracks_[i].events) {
+      WriteEvent(track_stream, e, running_status);
+    }
+    EndMidiTrack(track_stream, length_pos);
+  });
+}
+
+void MidiFile::WriteMidiFormat0(ByteWriter& stream) const {
+  WriteMidiHeader(stream, MidiFormat::SingleTrack, 1, ticks_per_qn_);
+  auto length_pos = BeginMidiTrack(stream);
+  uint8_t running_status = 0;
+  int64_t tick = 0;
+  int64_t total_ticks = 0;
+  MergedEvents merged(*this);
+  MergedEvents::Entry entry;
+  while (merged.Next(entry)) {
+    total_ticks = std::max(total_ticks, tracks_[entry.track].total_ticks);
+    // One end of track goes at the very end, and only the first track's name is kept.
+    if (entry.event->type == EventType::Meta) {
+      auto type = std::get<MetaEvent>(entry.event->inner_event).type;
+      if (type == MetaEventType::EndOfTrack || (type == MetaEventType::TrackName && entry.track != 0))
+        continue;
+    }
+    write_mb(stream, (uint32_t)(entry.tick - tick));
+    tick = entry.tick;
+    WriteEventBody(stream, *entry.event, running_status);
+  }
+  write_mb(stream, (uint32_t)(total_ticks - tick));
+  WriteEventBody(stream, TrackEvent{0, EventType::Meta, MetaEvent(MetaEventType::EndOfTrack)}, running_status);
+  EndMidiTrack(stream, length_pos);
+}
+
+void WriteCompactTrack(ByteWriter& stream, const CompactTrack& track) {
+  auto length_pos = BeginMidiTrack(stream);
+  uint8_t running_status = 0;
+  uint32_t last_tick = 0;
+  for (size_t i = 0; i < track.size(); i++) {
+    write_mb(stream, track.ticks[i] - last_tick);
+    last_tick = track.ticks[i];
+    uint32_t message = track.messages[i];
+    uint8_t status = message & 0xFF;
+    if (IsChannelStatus(status)) {
+      if (status != running_status || (message & CompactTrack::FORCE_STATUS)) {
+        stream.Put(status);
+        running_status = status;
+      }
+      stream.Put((message >> 8) & 0xFF);
+      auto type = (EventType)(status & 0xF0);
+      if (type != EventType::ProgramChange && type != EventType::ChannelPressure)
+        stream.Put((message >> 16) & 0xFF);
+    } else {
+      const auto& payload = track.payloads[message >> 8];
+      stream.Put(status);
+      if (status == 0xFF)
+        stream.Put((uint8_t)payload.meta_type);
+      write_mb(stream, payload.length);
+      stream.Write(track.payload_bytes(payload), payload.length);
+    }
+  }
+  EndMidiTrack(stream, length_pos);
+}
+
+void CompactMidiFile::WriteMidi(ByteWriter& stream) const {
+  WriteMidiHeader(stream, format, (uint16_t)tracks.size(), ticks_per_qn);
+  parallel_write(stream, tracks.size(), [&](ByteWriter& track_stream, size_t i) {
+    WriteCompactTrack(track_stream, tracks[i]);
+  });
+}
+
+void CompactTrack::AddMidi(uint32_t tick, uint8_t status, uint8_t data1, uint8_t data2, bool force_status) {
+  _ASSERT(IsChannelStatus(status));
+  ticks.push_back(tick);
+  messages.push_back(status | data1 << 8 | data2 << 16 | (force_status ? FORCE_STATUS : 0));
+}
+
+void CompactTrack::AddPayload(uint32_t tick, uint8_t status, MetaEventType meta_type, const uint8_t* data, uint32_t length) {
+  if (!arena)
+    arena = std::make_shared<PayloadArena>();
+  // Lyrics, chord names and markers repeat a lot, so text is interned.
+  auto handle = status == 0xFF && IsTextEvent(meta_type) ? arena->Intern(data, length) : arena->Store(data, length);
+  AddPayload(tick, status, meta_type, handle, length);
+}
+
+void CompactTrack::AddPayload(uint32_t tick, uint8_t status, MetaEventType meta_type, uint32_t handle, uint32_t length) {
+  if (payloads.size() >= (1 << 24))
+    throw std::exception("Too many meta and sysex events in track");
+  ticks.push_back(tick);
+  messages.push_back(status | (uint32_t)payloads.size() << 8);
+  payloads.push_back({(uint32_t)messages.size() - 1, meta_type, handle, length});
+}
+
+CompactTrack CompactTrack::FromMidiTrack(const MidiTrack& track) {
+  CompactTrack compact;
+  compact.name = track.name;
+  compact.total_ticks = track.total_ticks;
+  compact.ticks.reserve(track.events.size());
+  compact.messages.reserve(track.events.size());
+  // Meta events are encoded with the regular writer, then their payload is copied out.
+  ByteWriter scratch;
+  uint32_t tick = 0;
+  for (const auto& event : track.events) {
+    tick += event.delta_time;
+    if (event.type >= EventType::NoteOff && event.type <= EventType::PitchBend) {
+      const auto& midi_event = std::get<MidiEvent>(event.inner_event);
+      uint8_t status = midi_event.channel | (uint8_t)event.type;
+      uint8_t data1 = midi_event.note.key;
+      uint8_t data2 = midi_event.note.velocity;
+      if (event.type == EventType::PitchBend) {
+        data1 = midi_event.bend >> 8;
+        data2 = midi_event.bend & 0xFF;
+      } else if (event.type == EventType::ProgramChange || event.type == EventType::ChannelPressure) {
+        data2 = 0;
+      }
+      compact.AddMidi(tick, status, data1, data2, midi_event.force_status);
+    } else if (event.type == EventType::Meta) {
+      auto start = scratch.Tell();
+      uint8_t running_status = 0;
+      WriteEvent(scratch, event, running_status);
+      ByteReader reader(scratch.data() + start, scratch.size() - start);
+      auto raw = ReadRawEvent(reader, running_status);
+      compact.AddPayload(tick, raw.status, raw.meta_type, raw.payload, raw.length);
+    } else {
+      const auto& data = std::get<SysexEvent>(event.inner_event).data;
+      // The reader keeps the F0 of a start-of-exclusive in the data; F7 events have none.
+      if (!data.empty() && data[0] == 0xF0)
+        compact.AddPayload(tick, 0xF0, {}, data.data() + 1, (uint32_t)data.size() - 1);
+      else
+        compact.AddPayload(tick, 0xF7, {}, data.data(), (uint32_t)data.size());
     }
-    auto track_data = os.str();
-    write_be<uint32_t>(stream, track_data.size());
-    stream.write(track_data.data(), track_data.size());
   }
+  return compact;
 }
 
+MidiTrack CompactTrack::ToMidiTrack() const {
+  MidiTrack track{name, total_ticks, {}};
+  track.events.reserve(size());
+  for (size_t i = 0; i < size(); i++) {
+    RawEvent raw{delta_time(i), status(i), force_status(i), {data1(i), data2(i)}};
+    if (!IsChannelStatus(raw.status)) {
+      const auto& p = payload(i);
+      raw.meta_type = p.meta_type;
+      raw.payload = payload_bytes(p);
+      raw.length = p.length;
+    }
+    track.events.push_back(MakeTrackEvent(raw));
+  }
+  return track;
+}
+
+MergedEvents::MergedEvents(const MidiFile& midi) : tracks_(midi.tracks()) {
+  for (size_t i = 0; i < tracks_.size(); i++) {
+    if (!tracks_[i].events.empty())
+      heap_.push_back(Cursor{tracks_[i].events[0].delta_time, i, 0});
+  }
+  std::make_heap(heap_.begin(), heap_.end(), LaterCursor);
+}
+
+bool MergedEvents::LaterCursor(const Cursor& a, const Cursor& b) {
+  return a.tick != b.tick ? a.tick > b.tick : a.track > b.track;
+}
+
+// Moves the front cursor down to its place. Used after it moves later, which
+// is half the work of popping it and pushing it back.
+void MergedEvents::SiftDown() {
+  auto moved = heap_[0];
+  size_t i = 0;
+  while (true) {
+    size_t child = 2 * i + 1;
+    if (child >= heap_.size())
+      break;
+    if (child + 1 < heap_.size() && LaterCursor(heap_[child], heap_[child + 1]))
+      child++;
+    if (!LaterCursor(moved, heap_[child]))
+      break;
+    heap_[i] = heap_[child];
+    i = child;
+  }
+  heap_[i] = moved;
+}
+
+bool MergedEvents::Next(Entry& entry) {
+  if (heap_.empty())
+    return false;
+  auto& cursor = heap_[0];
+  const auto& events = tracks_[cursor.track].events;
+  entry = Entry{cursor.tick, cursor.track, &events[cursor.index]};
+  if (++cursor.index < events.size()) {
+    cursor.tick += events[cursor.index].delta_time;
+  } else {
+    cursor = heap_.back();
+    heap_.pop_back();
+    if (heap_.empty())
+      return true;
+  }
+  SiftDown();
+  return true;
+}
 
 const MidiTrack* MidiFile::GetTrackByName(std::string& name) const {
   for(const auto& track : tracks_) {
@@ -315,78 +743,176 @@ const MidiTrack* MidiFile::GetTrackByName(std::string& name) const {
   return nullptr;
 }
 
-const double MICROSECONDS_PER_SECOND = 1000000.0;
-inline double TicksToSeconds(uint16_t ticks_per_qn, int64_t ticks, uint32_t micros_per_qn) {
-  return ((double)ticks / ticks_per_qn) * (micros_per_qn / MICROSECONDS_PER_SECOND);
+const std::vector<int64_t>& MidiFile::event_ticks(size_t track) const {
+  if (event_ticks_.size() != tracks_.size())
+    event_ticks_.resize(tracks_.size());
+  auto& ticks = event_ticks_[track];
+  const auto& events = tracks_[track].events;
+  if (ticks.size() != events.size()) {
+    ticks.clear();
+    ticks.reserve(events.size());
+    int64_t tick = 0;
+    for (const auto& event : events) {
+      tick += event.delta_time;
+      ticks.push_back(tick);
+    }
+  }
+  return ticks;
+}
+
+static bool IsMeta(const TrackEvent& event, MetaEventType type) {
+  return event.type == EventType::Meta && std::get<MetaEvent>(event.inner_event).type == type;
 }
+
+static TrackEvent MakeNoteOff(uint8_t channel, uint8_t key) {
+  MidiEvent note_off{};
+  note_off.channel = channel;
+  note_off.note.key = key;
+  note_off.note.velocity = 0;
+  return TrackEvent{0, EventType::NoteOff, note_off};
+}
+
+MidiFile MidiFile::Slice(int64_t start_tick, int64_t end_tick) const {
+  if (start_tick < 0 || end_tick < start_tick)
+    throw std::exception("Invalid slice range");
+  std::vector<MidiTrack> tracks;
+  tracks.reserve(tracks_.size());
+  for (size_t i = 0; i < tracks_.size(); i++) {
+    const auto& source = tracks_[i];
+    const auto& ticks = event_ticks(i);
+    auto first = std::lower_bound(ticks.begin(), ticks.end(), start_tick) - ticks.begin();
+    auto last = std::lower_bound(ticks.begin(), ticks.end(), end_tick) - ticks.begin();
+
+    MidiTrack track{source.name, end_tick - start_tick, {}};
+    track.events.reserve(last - first + 4);
+    int64_t tick = start_tick;
+    auto add = [&](int64_t at, TrackEvent event) {
+      event.delta_time = (uint32_t)(at - tick);
+      tick = at;
+      track.events.push_back(std::move(event));
+    };
+
+    // The name and the tempo map header replace any such events right at the cut.
+    if (!source.name.empty())
+      add(start_tick, TrackEvent{0, EventType::Meta, MetaEvent(MetaEventType::TrackName, source.name)});
+    if (i == 0) {
+      auto marker = std::upper_bound(tempo_timesig_map_.begin(), tempo_timesig_map_.end(), start_tick,
+        [](int64_t t, const TimeSigTempoEvent& m) { return t < m.tick; });
+      if (marker != tempo_timesig_map_.begin()) {
+        auto denominator = (marker - 1)->denominator;
+        uint8_t power = 0;
+        while ((1 << power) < denominator) power++;
+        add(start_tick, TrackEvent{0, EventType::Meta, MetaEvent(MetaEventType::TimeSignature,
+          TimeSignatureEvent{(marker - 1)->numerator, power, 24, 8})});
+      }
+      const auto& segments = tempo_map_.segments();
+      auto segment = std::upper_bound(segments.begin(), segments.end(), start_tick,
+        [](int64_t t, const TempoMap::Segment& s) { return t < s.tick; }) - 1;
+      add(start_tick, TrackEvent{0, EventType::Meta, MetaEvent(MetaEventType::TempoEvent, segment->micros_per_qn)});
+    }
+
+    // Notes struck inside the cut, per channel and key.
+    std::array<uint16_t, 16 * 128> sounding{};
+    for (auto j = first; j < last; j++) {
+      const auto& event = source.events[j];
+      if (event.type == EventType::Meta) {
+        if (IsMeta(event, MetaEventType::EndOfTrack))
+          continue;
+        if (ticks[j] == start_tick && (IsMeta(event, MetaEventType::TrackName) ||
+            (i == 0 && (IsMeta(event, MetaEventType::TempoEvent) || IsMeta(event, MetaEventType::TimeSignature)))))
+          continue;
+      } else if (event.type == EventType::NoteOn || event.type == EventType::NoteOff) {
+        const auto& note = std::get<MidiEvent>(event.inner_event);
+        auto& count = sounding[note.channel << 7 | note.note.key];
+        if (event.type == EventType::NoteOn && note.note.velocity != 0)
+          count++;
+        else if (count == 0)
+          continue;
+        else
+          count--;
+      }
+      add(ticks[j], event);
+    }
+
+    for (size_t slot = 0; slot < sounding.size(); slot++) {
+      for (auto n = sounding[slot]; n > 0; n--)
+        add(end_tick, MakeNoteOff((uint8_t)(slot >> 7), slot & 0x7F));
+    }
+    add(end_tick, TrackEvent{0, EventType::Meta, MetaEvent(MetaEventType::EndOfTrack)});
+    tracks.push_back(std::move(track));
+  }
+  return MidiFile(format_, tracks, ticks_per_qn_);
+}
+
+MidiFile MidiFile::SliceSeconds(double start, double end) const {
+  return Slice(tempo_map_.SecondsToTick(start), tempo_map_.SecondsToTick(end));
+}
+
+const double MICROSECONDS_PER_SECOND = 1000000.0;
 inline double TempoToBpm(uint32_t micros_per_qn) {
   return 60.0 / (micros_per_qn / MICROSECONDS_PER_SECOND);
 }
-double MidiFile::ProcessTempoMap() {
-  double duration = 0;
-  int64_t ticks = 0; // running total of MIDI ticks
-  uint32_t micros_per_qn = 500000; // Current tempo. Defaults to 500,000 microseconds per QN
+void TempoMapBuilder::AddTempo(int64_t tick, uint32_t micros_per_qn) {
+  AddMarker(tick);
+  tempo_ = micros_per_qn;
+  tempo_map_.AddTempo(tick, micros_per_qn);
+}
 
-  // tempo+timesig map stuff
-  auto tempos = std::map<int64_t, uint32_t>();
-  auto sigs = std::map<int64_t, TimeSignatureEvent>();
-  auto durations = std::map<int64_t, double>();
+void TempoMapBuilder::AddTimeSignature(int64_t tick, const TimeSignatureEvent& sig) {
+  // Rejected here, before it waits to become a marker.
+  TimeSignatureDenominator(sig.denominator);
+  AddMarker(tick);
+  sig_ = sig;
+}
 
+void TempoMapBuilder::Finish() {
+  AddMarker(INT64_MAX);
+}
+
+// Turns the changes pending at marker_tick_ into a marker if the new change is on a later tick.
+void TempoMapBuilder::AddMarker(int64_t tick) {
+  if (tick == marker_tick_)
+    return;
+  if (tempo_ || sig_) {
+    double time = tempo_map_.TickToSeconds(marker_tick_);
+    if (tempo_)
+      bpm_ = TempoToBpm(*tempo_);
+    if (sig_) {
+      markers_.emplace_back(time, marker_tick_, bpm_, true, tempo_.has_value(), sig_->numerator, TimeSignatureDenominator(sig_->denominator));
+    } else {
+      // Tempo-only markers carry the time signature in effect, 4/4 if there isn't one yet.
+      uint8_t numerator = 4, denominator = 4;
+      if (!markers_.empty()) {
+        numerator = markers_.back().numerator;
+        denominator = markers_.back().denominator;
+      }
+      markers_.emplace_back(time, marker_tick_, bpm_, false, true, numerator, denominator);
+    }
+    tempo_.reset();
+    sig_.reset();
+  }
+  marker_tick_ = tick;
+}
+
+double MidiFile::ProcessTempoMap() {
+  TempoMapBuilder builder(ticks_per_qn_);
+  int64_t ticks = 0; // running total of MIDI ticks
   for (const auto& m : tracks_[0].events) // tempo map track
   {
     ticks += m.delta_time;
-    duration += TicksToSeconds(ticks_per_qn_, m.delta_time, micros_per_qn);
     if (m.type != EventType::Meta) continue;
     const MetaEvent& event = std::get<MetaEvent>(m.inner_event);
     if (event.type == MetaEventType::TempoEvent)
-    {
-      micros_per_qn = std::get<uint32_t>(event.event);
-      tempos[ticks] = micros_per_qn;
-      durations[ticks] = duration;
-    }
+      builder.AddTempo(ticks, std::get<uint32_t>(event.event));
     else if (event.type == MetaEventType::TimeSignature)
-    {
-      sigs[ticks] = std::get<TimeSignatureEvent>(event.event);
-      durations[ticks] = duration;
-    }
-  }
-  // calculate length for tracks extending past tempo map
-  for(auto i = 1u; i < tracks_.size(); i++)
-  {
-    if (tracks_[i].total_ticks <= ticks) continue;
-    long tmpTicks = 0;
-    for (const auto& m : tracks_[i].events)
-    {
-      tmpTicks += m.delta_time;
-      if (tmpTicks < ticks) continue;
-      ticks += m.delta_time;
-      duration += TicksToSeconds(ticks_per_qn_, m.delta_time, micros_per_qn);
-    }
+      builder.AddTimeSignature(ticks, std::get<TimeSignatureEvent>(event.event));
   }
+  builder.Finish();
+  tempo_map_ = std::move(builder.tempo_map());
+  tempo_timesig_map_ = std::move(builder.markers());
 
-  // more tempo+timesig map stuff
-  double bpm = 120.0;
-  TimeSignatureEvent timesig;
-  double time = 0.0;
-  for (const auto& [tick, time] : durations)
-  {
-    if (tempos.contains(tick) && sigs.contains(tick))
-    {
-      timesig = sigs[tick];
-      bpm = TempoToBpm(tempos[tick]);
-      tempo_timesig_map_.emplace_back(time, tick, bpm, true, true, timesig.numerator, (1 << timesig.denominator));
-    }
-    else if (tempos.contains(tick))
-    {
-      bpm = TempoToBpm(tempos[tick]);
-      const auto& lastTS = tempo_timesig_map_.back();
-      tempo_timesig_map_.emplace_back(time, tick, bpm, false, true, lastTS.numerator, (1 << lastTS.denominator));
-    }
-    else if (sigs.contains(tick))
-    {
-      timesig = sigs[tick];
-      tempo_timesig_map_.emplace_back(time, tick, bpm, true, false, timesig.numerator, (1 << timesig.denominator));
-    }
-  }
-  return duration;
-}
\ No newline at end of file
+  // The file lasts until the end of its longest track.
+  for (const auto& track : tracks_)
+    ticks = std::max(ticks, track.total_ticks);
+  return tempo_map_.TickToSeconds(ticks);
+}
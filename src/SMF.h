@@ -1,13 +1,24 @@
 #pragma once
 
+#include <bitset>
+#include <exception>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
+#include "PayloadArena.h"
+#include "TempoMap.h"
+
 // Oh, how I wish C++ had sum types. std::variant<...> will have to do.
 
+class ByteReader;
+class ByteWriter;
+class MidiVisitor;
+struct EventFilter;
 struct MidiTrack;
 struct TimeSigTempoEvent;
 struct TrackEvent;
@@ -25,8 +36,16 @@ class MidiFile {
 public:
   // Attempts to read a standard Midi file from the given stream.
   // Throws an exception if there's an issue.
-  static MidiFile ReadMidi(std::istream& stream);
-  void WriteMidi(std::ostream& stream);
+  static MidiFile ReadMidi(ByteReader& stream);
+  // Same as above, but only keeps the events the filter selects. The tempo map
+  // is built from what's kept, so keep tempo and time signature events if you need it.
+  static MidiFile ReadMidi(ByteReader& stream, const EventFilter& filter);
+  void WriteMidi(ByteWriter& stream);
+  // Writes every track merged into one, as a format 0 file.
+  void WriteMidiFormat0(ByteWriter& stream) const;
+  // Reads a standard Midi file one event at a time, handing each to the visitor
+  // instead of building tracks. Throws an exception if there's an issue.
+  static void Parse(ByteReader& stream, MidiVisitor& visitor);
 
   MidiFile(MidiFormat format, std::vector<MidiTrack>& tracks, uint16_t ticks_per_qn)
     : format_(format), tracks_(tracks), ticks_per_qn_(ticks_per_qn) {
@@ -35,10 +54,23 @@ public:
 
   const MidiTrack* GetTrackByName(std::string& name) const;
 
+  // Cuts the events in [start_tick, end_tick) out of every track into a new file
+  // that starts at start_tick. The first track opens with the tempo and time
+  // signature in effect at the cut, notes still sounding at the end of the cut
+  // are released there, and note-offs for notes struck before it are dropped.
+  // Throws an exception if the range is invalid.
+  MidiFile Slice(int64_t start_tick, int64_t end_tick) const;
+  // Same as above, with the range converted to ticks through the tempo map.
+  MidiFile SliceSeconds(double start, double end) const;
+  // The absolute tick of each event in a track. Built on first use, so calling
+  // this from several threads at once is not safe.
+  const std::vector<int64_t>& event_ticks(size_t track) const;
+
   MidiFormat format() const { return format_; }
   double duration() const { return duration_; }
   uint16_t ticks_per_qn() const { return ticks_per_qn_; }
   const std::vector<TimeSigTempoEvent>& tempo_timesig_map() const { return tempo_timesig_map_; }
+  const TempoMap& tempo_map() const { return tempo_map_; }
   const std::vector<MidiTrack>& tracks() const { return tracks_; }
 
 private:
@@ -46,7 +78,9 @@ private:
   double duration_;
   std::vector<MidiTrack> tracks_;
   std::vector<TimeSigTempoEvent> tempo_timesig_map_;
+  TempoMap tempo_map_;
   uint16_t ticks_per_qn_;
+  mutable std::vector<std::vector<int64_t>> event_ticks_;
   // Process the tempo map, also calculate the duration of the file.
   double ProcessTempoMap();
 };
@@ -86,6 +120,8 @@ enum class EventType : uint8_t {
   Sysex = 0xF0,
   SysexRaw = 0xF7
 };
+// True for the status bytes of channel voice messages (0x80-0xEF).
+inline bool IsChannelStatus(uint8_t status) { return status >= 0x80 && status < 0xF0; }
 
 enum class MetaEventType : uint8_t {
   SequenceNumber = 0x00,
@@ -109,6 +145,52 @@ enum class MetaEventType : uint8_t {
 };
 inline bool IsTextEvent(MetaEventType t) { return t >= MetaEventType::Text && t <= MetaEventType::DeviceName; }
 
+// Selects which events the readers keep. Skipped events are stepped over without
+// being built, and their delta times are folded into the next kept event so
+// ticks stay the same. End-of-track events are always kept.
+struct EventFilter {
+  // One bit per channel message type, from NoteOff (bit 0) to PitchBend (bit 6).
+  uint8_t midi_types{ 0x7F };
+  // One bit per channel. Only applies to channel messages.
+  uint16_t channels{ 0xFFFF };
+  // One bit per meta event type.
+  std::bitset<128> meta_types{ std::bitset<128>().set() };
+  bool sysex{ true };
+
+  // A filter that keeps nothing yet; Add the events you need.
+  static EventFilter None() {
+    EventFilter filter;
+    filter.midi_types = 0;
+    filter.meta_types.reset();
+    filter.sysex = false;
+    return filter;
+  }
+  // Adds a channel message type, all meta events, or sysex.
+  EventFilter& Add(EventType type) {
+    if (type == EventType::Meta)
+      meta_types.set();
+    else if (type == EventType::Sysex || type == EventType::SysexRaw)
+      sysex = true;
+    else
+      midi_types |= 1 << (((uint8_t)type >> 4) - 8);
+    return *this;
+  }
+  EventFilter& Add(MetaEventType type) {
+    meta_types.set((uint8_t)type & 0x7F);
+    return *this;
+  }
+  bool KeepsAll() const {
+    return midi_types == 0x7F && channels == 0xFFFF && meta_types.all() && sysex;
+  }
+  bool Keeps(uint8_t status, MetaEventType meta_type) const {
+    if (IsChannelStatus(status))
+      return (midi_types >> ((status >> 4) - 8) & 1) && (channels >> (status & 0xF) & 1);
+    if (status == 0xFF)
+      return meta_type == MetaEventType::EndOfTrack || meta_types.test((uint8_t)meta_type & 0x7F);
+    return sysex;
+  }
+};
+
 typedef struct {
   uint8_t h;
   uint8_t m;
@@ -123,6 +205,13 @@ typedef struct {
   uint8_t clocks_per_tick;
   uint8_t thirtysecond_notes_per_24_clocks;
 } TimeSignatureEvent;
+// The denominator a time signature event's power of two stands for. Throws an
+// exception if it's too large to fit in a byte.
+inline uint8_t TimeSignatureDenominator(uint8_t power) {
+  if (power > 7)
+    throw std::exception("Invalid time signature");
+  return (uint8_t)(1 << power);
+}
 
 typedef struct {
   uint8_t sharps;
@@ -210,4 +299,184 @@ struct TrackEvent {
   uint32_t delta_time;
   EventType type;
   std::variant<MidiEvent, MetaEvent, SysexEvent> inner_event;
-};
\ No newline at end of file
+};
+
+// Builds the tempo map and the tempo / time signature markers of a midi from
+// the tempo track's events, fed in tick order. Tempo and time signature changes
+// on the same tick become one marker.
+class TempoMapBuilder {
+public:
+  explicit TempoMapBuilder(uint16_t ticks_per_qn) : tempo_map_(ticks_per_qn) {}
+
+  void AddTempo(int64_t tick, uint32_t micros_per_qn);
+  void AddTimeSignature(int64_t tick, const TimeSignatureEvent& sig);
+  // Adds the last marker. Call once every event is in.
+  void Finish();
+
+  TempoMap& tempo_map() { return tempo_map_; }
+  std::vector<TimeSigTempoEvent>& markers() { return markers_; }
+
+private:
+  void AddMarker(int64_t tick);
+
+  TempoMap tempo_map_;
+  std::vector<TimeSigTempoEvent> markers_;
+  // The tempo that follows the last marker.
+  double bpm_{ 120.0 };
+  // Changes seen at marker_tick_ that aren't in a marker yet.
+  int64_t marker_tick_{ 0 };
+  std::optional<uint32_t> tempo_;
+  std::optional<TimeSignatureEvent> sig_;
+};
+
+// Receives the events of a midi file from MidiFile::Parse, in file order.
+// Ticks are absolute within the track. Payload pointers are only valid during
+// the call. Override the callbacks you need; the rest do nothing.
+class MidiVisitor {
+public:
+  virtual ~MidiVisitor() = default;
+  virtual void Header(MidiFormat format, uint16_t num_tracks, uint16_t ticks_per_qn) {}
+  virtual void TrackBegin(uint16_t track) {}
+  // Channel voice message. data2 is 0 for program change and channel pressure.
+  virtual void ChannelMessage(int64_t tick, uint8_t status, uint8_t data1, uint8_t data2) {}
+  virtual void Meta(int64_t tick, MetaEventType type, const uint8_t* data, uint32_t length) {}
+  // status is 0xF0 or 0xF7. The data does not include the status byte.
+  virtual void Sysex(int64_t tick, uint8_t status, const uint8_t* data, uint32_t length) {}
+  virtual void TrackEnd(uint16_t track, int64_t total_ticks) {}
+};
+
+// Walks the events of every track of a MidiFile in tick order, using a heap
+// with one cursor per track. Events on the same tick come in track order, and
+// in file order within a track. The MidiFile must outlive this object.
+class MergedEvents {
+public:
+  struct Entry {
+    // Absolute tick of the event.
+    int64_t tick;
+    size_t track;
+    const TrackEvent* event;
+  };
+  explicit MergedEvents(const MidiFile& midi);
+
+  // Moves to the next event. Returns false once every track is done.
+  bool Next(Entry& entry);
+
+private:
+  struct Cursor {
+    int64_t tick;
+    size_t track;
+    size_t index;
+  };
+  // Heap order, so the earliest cursor comes out first.
+  static bool LaterCursor(const Cursor& a, const Cursor& b);
+  void SiftDown();
+
+  const std::vector<MidiTrack>& tracks_;
+  std::vector<Cursor> heap_;
+};
+
+// For writing a standard midi file without building a MidiFile, such as when
+// converting from another format as it's read. Each track's events go between
+// BeginMidiTrack, which returns where the track length goes, and EndMidiTrack.
+void WriteMidiHeader(ByteWriter& stream, MidiFormat format, uint16_t num_tracks, uint16_t ticks_per_qn);
+size_t BeginMidiTrack(ByteWriter& stream);
+void EndMidiTrack(ByteWriter& stream, size_t length_pos);
+
+// Column-oriented alternative to MidiTrack for large tracks. Each event costs an
+// absolute tick and a packed 4-byte message; meta and sysex payloads live in a
+// side table the message points into, with their bytes in an arena that the
+// tracks of a file share. Text payloads are interned.
+struct CompactTrack {
+  // Packed message layout, low byte first: status, data1, data2, flags.
+  // Meta and sysex messages keep the status byte and store their payload index
+  // in the upper 24 bits instead.
+  static constexpr uint32_t FORCE_STATUS = 0x01000000;
+  struct Payload {
+    // Index of the event this payload belongs to.
+    uint32_t event;
+    // The meta event type. Unused for sysex.
+    MetaEventType meta_type;
+    // Arena handle of the payload bytes.
+    uint32_t handle;
+    uint32_t length;
+  };
+
+  std::string name;
+  int64_t total_ticks{};
+  // Absolute tick of each event.
+  std::vector<uint32_t> ticks;
+  // Packed message of each event.
+  std::vector<uint32_t> messages;
+  // Meta and sysex payloads, in event order.
+  std::vector<Payload> payloads;
+  // Created on the first payload if the track wasn't given one.
+  std::shared_ptr<PayloadArena> arena;
+
+  size_t size() const { return messages.size(); }
+  uint32_t delta_time(size_t i) const { return i == 0 ? ticks[0] : ticks[i] - ticks[i - 1]; }
+  uint8_t status(size_t i) const { return messages[i] & 0xFF; }
+  uint8_t data1(size_t i) const { return (messages[i] >> 8) & 0xFF; }
+  uint8_t data2(size_t i) const { return (messages[i] >> 16) & 0xFF; }
+  bool force_status(size_t i) const { return (messages[i] & FORCE_STATUS) != 0; }
+  // Only valid for meta and sysex events.
+  const Payload& payload(size_t i) const { return payloads[messages[i] >> 8]; }
+  const uint8_t* payload_bytes(const Payload& p) const { return arena->Data(p.handle); }
+
+  void AddMidi(uint32_t tick, uint8_t status, uint8_t data1, uint8_t data2, bool force_status);
+  void AddPayload(uint32_t tick, uint8_t status, MetaEventType meta_type, const uint8_t* data, uint32_t length);
+  // Adds a payload that is already in this track's arena.
+  void AddPayload(uint32_t tick, uint8_t status, MetaEventType meta_type, uint32_t handle, uint32_t length);
+
+  static CompactTrack FromMidiTrack(const MidiTrack& track);
+  MidiTrack ToMidiTrack() const;
+};
+
+// A standard midi file read straight into compact tracks. No tempo map is built.
+struct CompactMidiFile {
+  // Attempts to read a standard Midi file from the given stream.
+  // Throws an exception if there's an issue.
+  static CompactMidiFile ReadMidi(ByteReader& stream, const EventFilter& filter = {});
+  void WriteMidi(ByteWriter& stream) const;
+
+  MidiFormat format;
+  uint16_t ticks_per_qn;
+  std::vector<CompactTrack> tracks;
+};
+
+// Opens a standard midi file without decoding its events. Each track chunk is
+// only scanned up to its name, and decoded the first time it's asked for.
+// The buffer behind the reader must outlive this object.
+class LazyMidiFile {
+public:
+  // Reads the header and locates the track chunks.
+  // Throws an exception if there's an issue.
+  static LazyMidiFile Open(ByteReader& stream);
+
+  MidiFormat format() const { return format_; }
+  uint16_t ticks_per_qn() const { return ticks_per_qn_; }
+  size_t num_tracks() const { return chunks_.size(); }
+  // The name of the track as given by a TrackName event before its first non-zero tick.
+  const std::string& track_name(size_t index) const { return chunks_[index].name; }
+
+  // Decodes the track if it hasn't been already.
+  const MidiTrack& GetTrack(size_t index);
+  // Returns the first track with the given name, or nullptr if there isn't one.
+  const MidiTrack* GetTrackByName(const std::string& name);
+  // Decodes every remaining track and builds a full MidiFile.
+  MidiFile ToMidiFile();
+
+private:
+  struct Chunk {
+    size_t offset;
+    std::string name;
+    std::optional<MidiTrack> track;
+  };
+  LazyMidiFile(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  const uint8_t* data_;
+  size_t size_;
+  MidiFormat format_;
+  uint16_t ticks_per_qn_;
+  std::vector<Chunk> chunks_;
+  std::unordered_map<std::string, size_t> names_;
+};
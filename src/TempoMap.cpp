@@ -0,0 +1,65 @@
+#include "TempoMap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+
+const double MICROSECONDS_PER_SECOND = 1000000.0;
+
+TempoMap::TempoMap(uint16_t ticks_per_qn) : ticks_per_qn_(ticks_per_qn) {
+  segments_.push_back({0, 0.0, DEFAULT_MICROS_PER_QN});
+}
+
+void TempoMap::AddTempo(int64_t tick, uint32_t micros_per_qn) {
+  auto& last = segments_.back();
+  if (tick < last.tick)
+    throw std::exception("Tempo changes must be added in tick order");
+  if (tick == last.tick) {
+    last.micros_per_qn = micros_per_qn;
+    return;
+  }
+  segments_.push_back({tick, SegmentSeconds(last, tick), micros_per_qn});
+}
+
+size_t TempoMap::FindSegment(int64_t tick) const {
+  auto it = std::upper_bound(segments_.begin(), segments_.end(), tick,
+    [](int64_t t, const Segment& s) { return t < s.tick; });
+  return it == segments_.begin() ? 0 : (it - segments_.begin()) - 1;
+}
+
+double TempoMap::SegmentSeconds(const Segment& segment, int64_t tick) const {
+  return segment.seconds + ((double)(tick - segment.tick) / ticks_per_qn_) * (segment.micros_per_qn / MICROSECONDS_PER_SECOND);
+}
+
+double TempoMap::TickToSeconds(int64_t tick) const {
+  return SegmentSeconds(segments_[FindSegment(tick)], tick);
+}
+
+int64_t TempoMap::SecondsToTick(double seconds) const {
+  auto it = std::upper_bound(segments_.begin(), segments_.end(), seconds,
+    [](double s, const Segment& seg) { return s < seg.seconds; });
+  const auto& segment = it == segments_.begin() ? segments_[0] : *(it - 1);
+  double ticks = (seconds - segment.seconds) * MICROSECONDS_PER_SECOND / segment.micros_per_qn * ticks_per_qn_;
+  // Flooring would land on the tick before when the time of a tick rounds down,
+  // so take the nearest tick and step back if it actually starts later.
+  int64_t tick = segment.tick + std::llround(ticks);
+  if (TickToSeconds(tick) > seconds)
+    tick--;
+  return tick;
+}
+
+void TempoMap::TicksToSeconds(const int64_t* ticks, double* seconds, size_t count) const {
+  size_t seg = 0;
+  int64_t last_tick = INT64_MIN;
+  for (size_t i = 0; i < count; i++) {
+    auto tick = ticks[i];
+    if (tick < last_tick) {
+      seg = FindSegment(tick);
+    } else {
+      while (seg + 1 < segments_.size() && segments_[seg + 1].tick <= tick)
+        seg++;
+    }
+    last_tick = tick;
+    seconds[i] = SegmentSeconds(segments_[seg], tick);
+  }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+// Sorted index of tempo segments for converting between MIDI ticks and seconds.
+// Built in a single pass by appending tempo changes in tick order.
+class TempoMap {
+public:
+  struct Segment {
+    // The MIDI tick at which this tempo starts.
+    int64_t tick;
+    // The time, in seconds, at that tick.
+    double seconds;
+    // The tempo, in microseconds per quarter note.
+    uint32_t micros_per_qn;
+  };
+  static constexpr uint32_t DEFAULT_MICROS_PER_QN = 500000;
+
+  explicit TempoMap(uint16_t ticks_per_qn = 480);
+
+  // Appends a tempo change. Ticks must not go backwards; a change at the same
+  // tick as the previous one replaces it.
+  void AddTempo(int64_t tick, uint32_t micros_per_qn);
+
+  double TickToSeconds(int64_t tick) const;
+  // Returns the last tick that starts at or before the given time.
+  int64_t SecondsToTick(double seconds) const;
+  // Converts many ticks at once. Ascending runs are converted with a forward
+  // scan instead of a search per tick.
+  void TicksToSeconds(const int64_t* ticks, double* seconds, size_t count) const;
+
+  uint16_t ticks_per_qn() const { return ticks_per_qn_; }
+  // Always starts with a segment at tick 0, at the default tempo if the midi sets none.
+  const std::vector<Segment>& segments() const { return segments_; }
+
+private:
+  size_t FindSegment(int64_t tick) const;
+  double SegmentSeconds(const Segment& segment, int64_t tick) const;
+
+  uint16_t ticks_per_qn_;
+  std::vector<Segment> segments_;
+};
@@ -4,14 +4,16 @@
 
 #include "Data.h"
 #include "HmxAsset.h"
+#include "MappedFile.h"
 #include "MidiFileResource.h"
 #include "SMF.h"
+#include "stream-helpers.h"
 #include "mogg/VorbisEncrypter.h"
 #include "mogg/CCallbacks.h"
 
 #define VERSION "0.5"
 
-int doMidi(std::ifstream& file){
+int doMidi(ByteReader& file){
   try {
     auto midi = MidiFile::ReadMidi(file);
     printf("Format: %d, Duration: %f, TPQN: %d, %d tracks.\n",
@@ -32,7 +34,7 @@ int doMidi(std::ifstream& file){
   }
 }
 
-int doMidiCopy(std::ifstream& file, const char* out) {
+int doMidiCopy(ByteReader& file, const char* out) {
   try {
     auto midi = MidiFile::ReadMidi(file);
     std::ofstream outfile(out, std::ios::out | std::ios::binary);
@@ -40,7 +42,9 @@ int doMidiCopy(std::ifstream& file, const char* out) {
       printf("Could not open output file\n");
       return 1;
     }
-    midi.WriteMidi(outfile);
+    ByteWriter writer;
+    midi.WriteMidi(writer);
+    writer.WriteTo(outfile);
     printf("Wrote output to %s\n", out);
     return 0;
   } catch (const std::exception& ex) {
@@ -49,7 +53,7 @@ int doMidiCopy(std::ifstream& file, const char* out) {
   }
 }
 
-int doMidiFileResource(std::ifstream& file) {
+int doMidiFileResource(ByteReader& file) {
   try {
     auto midi = MidiFileResource::Deserialize(file);
     printf("Format: %d, %d tracks.\n",
@@ -71,7 +75,7 @@ int doMidiFileResource(std::ifstream& file) {
   }
 }
 
-int doMidiFileResourceCopy(std::ifstream& file, const char* out) {
+int doMidiFileResourceCopy(ByteReader& file, const char* out) {
   try {
     auto midi = MidiFileResource::Deserialize(file);
     std::ofstream outfile(out, std::ios::out | std::ios::binary);
@@ -79,7 +83,9 @@ int doMidiFileResourceCopy(std::ifstream& file, const char* out) {
       printf("Could not open output file\n");
       return 1;
     }
-    midi.Serialize(outfile);
+    ByteWriter writer;
+    midi.Serialize(writer);
+    writer.WriteTo(outfile);
     printf("Wrote output to %s\n", out);
     return 0;
   } catch (const std::exception& ex) {
@@ -88,16 +94,16 @@ int doMidiFileResourceCopy(std::ifstream& file, const char* out) {
   }
 }
 
-int doMidiFileResourceConvert(std::ifstream& file, const char* out) {
+int doMidiFileResourceConvert(ByteReader& file, const char* out) {
   try {
-    auto midi = MidiFile::ReadMidi(file);
     std::ofstream outfile(out, std::ios::out | std::ios::binary);
     if (!outfile.is_open()) {
       printf("Could not open output file\n");
       return 1;
     }
-    MidiFileResource mfr = MidiFileResource::FromMidi(midi);
-    mfr.Serialize(outfile);
+    ByteWriter writer;
+    MidiFileResource::ConvertMidi(file, writer);
+    writer.WriteTo(outfile);
     printf("Wrote output to %s\n", out);
     return 0;
   } catch (const std::exception& ex) {
@@ -106,16 +112,16 @@ int doMidiFileResourceConvert(std::ifstream& file, const char* out) {
   }
 }
 
-int doMidiFileResourceExtract(std::ifstream& file, const char* out) {
+int doMidiFileResourceExtract(ByteReader& file, const char* out) {
   try {
-    auto midi = MidiFileResource::Deserialize(file);
     std::ofstream outfile(out, std::ios::out | std::ios::binary);
     if (!outfile.is_open()) {
       printf("Could not open output file\n");
       return 1;
     }
-    MidiFile mf = midi.ExtractMidi();
-    mf.WriteMidi(outfile);
+    ByteWriter writer;
+    MidiFileResource::ExtractMidi(file, writer);
+    writer.WriteTo(outfile);
     printf("Wrote output to %s\n", out);
     return 0;
   } catch (const std::exception& ex) {
@@ -124,11 +130,20 @@ int doMidiFileResourceExtract(std::ifstream& file, const char* out) {
   }
 }
 
-int doUexp(std::ifstream& file) {
+int doMidiFileResourceLint(ByteReader& file) {
+  auto issues = MidiFileResource::Lint(file);
+  for (const auto& issue : issues) {
+    printf("0x%08zx: %s\n", issue.offset, issue.message.c_str());
+  }
+  printf("%zu issues found.\n", issues.size());
+  return issues.empty() ? 0 : 1;
+}
+
+int doUexp(ByteReader& file) {
   try {
-    auto uexp = HmxAsset::LoadAsset(file);
+    auto uexp = LazyHmxAsset::Open(file);
     int i = 1;
-    for(const auto& resource : uexp.files_) {
+    for(const auto& resource : uexp.resources()) {
       printf("%2d %s: %s\n",
         i++,
         resource.type.c_str(),
@@ -141,9 +156,9 @@ int doUexp(std::ifstream& file) {
   }
 }
 
-int doExtractUexp(std::ifstream& file, char* path) {
+int doExtractUexp(ByteReader& file, char* path) {
   try {
-    auto uexp = HmxAsset::LoadAsset(file);
+    auto uexp = LazyHmxAsset::Open(file);
     auto resources = uexp.GetResourcesOfType("MidiFileResource");
     if (resources.size() == 0) {
       printf("There are no MidiFileResources in the uexp file.");
@@ -161,7 +176,8 @@ int doExtractUexp(std::ifstream& file, char* path) {
         printf("Could not open output file %s\n", resource_path.string().c_str());
         return 1;
       }
-      outfile.write(resource->data.data(), resource->data.size());
+      auto data = uexp.GetData(*resource);
+      outfile.write(data.data(), data.size());
       printf("Saved %s\n", resource_path.string().c_str());
     }
     return 0;
@@ -171,9 +187,9 @@ int doExtractUexp(std::ifstream& file, char* path) {
   }
 }
 
-int doDta(std::ifstream& file) {
+int doDta(const MappedFile& file) {
   try {
-    auto root = DataReadStream(file);
+    auto root = DataReadString(file.view());
     root->Print(std::cout);
     std::cout << std::endl;
     return 0;
@@ -182,7 +198,7 @@ int doDta(std::ifstream& file) {
     return -1;
   }
 }
-int doDtb(std::ifstream& file) {
+int doDtb(ByteReader& file) {
   try {
     DataArray root;
     root.Load(file);
@@ -194,15 +210,17 @@ int doDtb(std::ifstream& file) {
     return -1;
   }
 }
-int doDta2Dtb(std::ifstream& file, const char* out) {
+int doDta2Dtb(const MappedFile& file, const char* out) {
   try {
-    auto root = DataReadStream(file);
+    auto root = DataReadString(file.view());
     std::ofstream outfile(out, std::ios::out | std::ios::binary);
     if (!outfile.is_open()) {
       printf("Could not open output file\n");
       return 1;
     }
-    root->Save(outfile);
+    ByteWriter writer;
+    root->Save(writer);
+    writer.WriteTo(outfile);
     printf("Wrote output to %s\n", out);
     return 0;
   }
@@ -211,7 +229,7 @@ int doDta2Dtb(std::ifstream& file, const char* out) {
     return -1;
   }
 }
-int doDtb2Dta(std::ifstream& file, const char* out) {
+int doDtb2Dta(ByteReader& file, const char* out) {
   try {
     DataArray root;
     root.Load(file);
@@ -230,22 +248,25 @@ int doDtb2Dta(std::ifstream& file, const char* out) {
   }
 }
 
-int doOgg2Mogg(std::ifstream& file, const char* out) {
+int doOgg2Mogg(ByteReader& file, const char* out) {
 	std::ofstream outfile(out, std::ios::out | std::ios::binary);
 	if (!outfile.is_open()) {
 		puts("Could not open output file");
     return 1;
 	}
 	try {
-		VorbisEncrypter ve(&file, 0x10, cppCallbacks<std::ifstream>);
+		VorbisEncrypter ve(&file, 0x10, readerCallbacks);
     printf("Sample rate: %u\n", ve.sample_rate);
     printf("Mogg size: %zd bytes\n", ve.LengthRaw());
+		ByteWriter writer;
+		writer.Reserve(ve.LengthRaw());
 		char buf[8192];
 		size_t read = 0;
 		do {
 			read = ve.ReadRaw(buf, 1, 8192);
-			outfile.write(buf, read);
+			writer.Write(buf, read);
 		} while (read != 0);
+		writer.WriteTo(outfile);
     return 0;
 	} catch(std::exception& e) {
 		printf("Error: %s\n", e.what());
@@ -261,8 +282,7 @@ int doConsole() {
       std::getline(std::cin, buf);
       if (buf.length() == 0)
         continue;
-      std::istringstream iss{buf};
-      auto root = DataReadStream(iss);
+      auto root = DataReadString(buf);
       for (const auto& node : root->nodes()) {
         node.Evaluate().Print(std::cout, 0);
         std::cout << std::endl;
@@ -282,6 +302,7 @@ int main(int argc, char** argv) {
     puts(" convert : Convert a mid to a MidiFileResource");
     puts(" extract : Extracts the midi from a MidiFileResource");
     puts(" mid/mfr : Show some debug info for a mid or MidiFileResource");
+    puts(" lint    : Check a MidiFileResource for problems without loading it");
     puts(" midcopy : Copy a mid to a mid (tests that serialization/deserialization is OK)");
     puts(" mfrcopy : Copy a MidiFileResource to a MidiFileResource (tests that serialization/deserialization is OK)");
     puts(" uexp    : Print debug info about a .uexp");
@@ -304,38 +325,41 @@ int main(int argc, char** argv) {
   }
 
   // 1-file actions
-  auto file = std::ifstream(argv[2], std::ios::binary | std::ios::in);
+  MappedFile file(argv[2]);
+  auto reader = file.Reader();
   if (!file.is_open()){
     printf("Could not open file %s\n", argv[2]);
     return 1;
   } else if (!strcmp("mid", argv[1])) {
-    return doMidi(file);
+    return doMidi(reader);
   } else if (!strcmp("mfr", argv[1])) {
-    return doMidiFileResource(file);
+    return doMidiFileResource(reader);
+  } else if (!strcmp("lint", argv[1])) {
+    return doMidiFileResourceLint(reader);
   } else if (!strcmp("uexp", argv[1])) {
-    return doUexp(file);
+    return doUexp(reader);
   } else if (!strcmp("dtb", argv[1])) {
-    return doDtb(file);
+    return doDtb(reader);
   } else if (!strcmp("dta", argv[1])) {
     return doDta(file);
   }
   // 2-file actions
   else if (!strcmp("uexp_ex", argv[1]) && argc > 3) {
-    return doExtractUexp(file, argv[2]);
+    return doExtractUexp(reader, argv[2]);
   } else if (!strcmp("mfrcopy", argv[1]) && argc > 3) {
-    return doMidiFileResourceCopy(file, argv[3]);
+    return doMidiFileResourceCopy(reader, argv[3]);
   } else if (!strcmp("midcopy", argv[1]) && argc > 3) {
-    return doMidiCopy(file, argv[3]);
+    return doMidiCopy(reader, argv[3]);
   } else if (!strcmp("convert", argv[1]) && argc > 3) {
-    return doMidiFileResourceConvert(file, argv[3]);
+    return doMidiFileResourceConvert(reader, argv[3]);
   } else if (!strcmp("extract", argv[1]) && argc > 3) {
-    return doMidiFileResourceExtract(file, argv[3]);
+    return doMidiFileResourceExtract(reader, argv[3]);
   } else if (!strcmp("dta2dtb", argv[1]) && argc > 3) {
     return doDta2Dtb(file, argv[3]);
   } else if (!strcmp("dtb2dta", argv[1]) && argc > 3) {
-    return doDtb2Dta(file, argv[3]);
+    return doDtb2Dta(reader, argv[3]);
   } else if (!strcmp("ogg2mogg", argv[1]) && argc > 3) {
-    return doOgg2Mogg(file, argv[3]);
+    return doOgg2Mogg(reader, argv[3]);
   } else {
     goto usage;
   }
@@ -1,6 +1,9 @@
 #include "CCallbacks.h"
+#include <algorithm>
 #include <fstream>
 
+#include "../stream-helpers.h"
+
 size_t mogg_read(void *ptr, size_t size, size_t nmemb, void *datasource) {
 	return fread(ptr, size, nmemb, (FILE*)datasource);
 }
@@ -21,6 +24,40 @@ ov_callbacks cCallbacks = {
 	mogg_tell
 };
 
+size_t reader_read(void *ptr, size_t size, size_t nmemb, void *datasource) {
+	auto *reader = static_cast<ByteReader*>(datasource);
+	if (size == 0) return 0;
+	size_t count = std::min(nmemb, reader->Remaining() / size);
+	memcpy(ptr, reader->Take(count * size), count * size);
+	return count;
+}
+int reader_seek(void *datasource, ogg_int64_t offset, int whence) {
+	auto *reader = static_cast<ByteReader*>(datasource);
+	ogg_int64_t pos;
+	switch (whence) {
+		case SEEK_SET: pos = offset; break;
+		case SEEK_CUR: pos = reader->Tell() + offset; break;
+		case SEEK_END: pos = reader->size() + offset; break;
+		default: return -1;
+	}
+	if (pos < 0 || (uint64_t)pos > reader->size()) return -1;
+	reader->Seek((size_t)pos);
+	return 0;
+}
+int reader_close(void *datasource) {
+	return 0;
+}
+long reader_tell(void *datasource) {
+	return (long)static_cast<ByteReader*>(datasource)->Tell();
+}
+
+ov_callbacks readerCallbacks = {
+	reader_read,
+	reader_seek,
+	reader_close,
+	reader_tell
+};
+
 template<> int close_stream<std::ifstream>(void* datasource) {
 		auto *file = static_cast<std::ifstream*>(datasource);
 		file->close();
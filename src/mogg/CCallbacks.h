@@ -8,6 +8,8 @@
 
 // Callbacks using standard C FILE* as a datasource.
 extern ov_callbacks cCallbacks;
+// Callbacks using an in-memory ByteReader* as a datasource.
+extern ov_callbacks readerCallbacks;
 
 template<typename T> int close_stream(void* datasource);
 template<> int close_stream<std::ifstream>(void* datasource);
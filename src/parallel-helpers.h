@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "stream-helpers.h"
+
+// Calls func(i) for every i in [0, count), spread over up to one thread per core.
+// The threads are started for each call, and if none can be started the calls
+// all run on this one. Blocks until every call has returned. If any call throws,
+// the exception from the lowest index is rethrown, the same one a sequential loop
+// would hit first.
+template<typename Func>
+void parallel_for(size_t count, Func&& func) {
+  size_t num_threads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < count; i++)
+      func(i);
+    return;
+  }
+  std::atomic<size_t> next{ 0 };
+  std::vector<std::exception_ptr> errors(count);
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      try {
+        func(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  try {
+    for (size_t t = 1; t < num_threads; t++)
+      threads.emplace_back(worker);
+  } catch (const std::system_error&) {
+    // Out of threads. The ones that started and this one share the rest.
+  }
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+  for (const auto& error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+
+// Calls func(writer, i) for every i in [0, count) in parallel, each with its own
+// writer, then appends the writers to stream in index order. The output is the
+// same as calling func(stream, i) in a loop, as long as func only depends on i.
+template<typename Func>
+void parallel_write(ByteWriter& stream, size_t count, Func&& func) {
+  std::vector<ByteWriter> parts(count);
+  parallel_for(count, [&](size_t i) {
+    func(parts[i], i);
+  });
+  size_t total = stream.size();
+  for (const auto& part : parts)
+    total += part.size();
+  stream.Reserve(total);
+  for (const auto& part : parts)
+    stream.Write(part.data(), part.size());
+}
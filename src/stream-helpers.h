@@ -1,23 +1,80 @@
 #pragma once
 
-#include <functional>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
+// Bounds-checked read cursor over a contiguous, caller-owned buffer.
+// The buffer must outlive the reader and anything that views into it.
+class ByteReader {
+public:
+  ByteReader(const void* data, size_t size)
+    : data_((const uint8_t*)data), size_(size) {}
+  explicit ByteReader(std::string_view data)
+    : ByteReader(data.data(), data.size()) {}
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  size_t Tell() const { return pos_; }
+  size_t Remaining() const { return size_ - pos_; }
+  // Pointer to the byte at the cursor. Check Remaining() before reading through it.
+  const uint8_t* Current() const { return data_ + pos_; }
+  bool Eof() const { return pos_ >= size_; }
+  void Seek(size_t pos) {
+    if (pos > size_)
+      throw std::exception("Attempt to seek past end of data");
+    pos_ = pos;
+  }
+  void Skip(size_t count) { Take(count); }
+
+  // Returns a pointer to the next `count` bytes and advances past them.
+  const uint8_t* Take(size_t count) {
+    if (count > size_ - pos_)
+      throw std::exception("Unexpected end of data");
+    auto* ret = data_ + pos_;
+    pos_ += count;
+    return ret;
+  }
+  uint8_t Peek() const {
+    if (pos_ >= size_)
+      throw std::exception("Unexpected end of data");
+    return data_[pos_];
+  }
+  uint8_t Get() {
+    uint8_t ret = Peek();
+    pos_++;
+    return ret;
+  }
+  // Returns a reader over the next `count` bytes and advances past them.
+  ByteReader Sub(size_t count) {
+    return ByteReader(Take(count), count);
+  }
+
+private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_{ 0 };
+};
+
 // Read little-endian value
 template<typename T>
-T read(std::istream& stream) {
+T read(ByteReader& stream) {
   T ret;
-  stream.read((char*)&ret, sizeof(T));
+  memcpy(&ret, stream.Take(sizeof(T)), sizeof(T));
   return ret;
 }
 
 // Read big-endian value
 template<typename T>
-T read_be(std::istream& stream) {
-  uint8_t bytes[sizeof(T)];
-  stream.read((char*)bytes, sizeof(T));
+T read_be(ByteReader& stream) {
+  const uint8_t* bytes = stream.Take(sizeof(T));
   T ret;
   uint8_t *p = (uint8_t*)&ret;
   for (int i = 1; i <= sizeof(T); i++) {
@@ -25,68 +82,177 @@ T read_be(std::istream& stream) {
   }
   return ret;
 }
-template<> uint8_t read_be(std::istream& stream);
+template<> inline uint8_t read_be(ByteReader& stream) {
+  return stream.Get();
+}
 
 // Read big-endian 24 bit integer
-uint32_t read_i24_be(std::istream& stream);
+uint32_t read_i24_be(ByteReader& stream);
 
 // Read midi multi-byte
-uint32_t read_mb(std::istream& stream);
+inline uint32_t read_mb(ByteReader& stream) {
+  uint32_t ret = 0;
+  for (int i = 0; i < 4; i++) {
+    uint8_t b = stream.Get();
+    ret = (ret << 7) | (b & 0x7F);
+    if (b < 0x80)
+      return ret;
+  }
+  throw std::exception("Variable-length MIDI number > 4 bytes");
+}
 // Read fixed-length string
-std::string read_str(std::istream& stream, uint32_t length);
+std::string read_str(ByteReader& stream, uint32_t length);
 // Read length-prefixed string
-std::string read_symbol(std::istream& stream);
+std::string read_symbol(ByteReader& stream);
 // Read length-prefixed + null-terminated string
-std::string read_ue4text(std::istream& stream);
+std::string read_ue4text(ByteReader& stream);
 
+// True for types whose in-memory layout is exactly their on-disk layout, so
+// arrays of them can be copied in and out with one memcpy. Structs opt in by
+// specializing this next to a static_assert on their size.
 template<typename T>
-void read_array(std::istream& stream, T* data, size_t count, std::function<T(std::istream&)> read_func) {
-  for(auto i = 0u; i < count; i++) {
-    data[i] = read_func(stream);
+constexpr bool is_raw_layout_v = std::is_arithmetic_v<T>;
+
+// Default element function for the array helpers: copy the elements verbatim.
+struct raw_layout_t {};
+
+template<typename T, typename ReadFunc = raw_layout_t>
+void read_array(ByteReader& stream, T* data, size_t count, ReadFunc read_func = {}) {
+  if constexpr (std::is_same_v<ReadFunc, raw_layout_t>) {
+    static_assert(is_raw_layout_v<T>, "Type needs an element read function");
+    if (count > stream.Remaining() / sizeof(T))
+      throw std::exception("Unexpected end of data");
+    memcpy(data, stream.Take(count * sizeof(T)), count * sizeof(T));
+  } else {
+    for(auto i = 0u; i < count; i++) {
+      data[i] = read_func(stream);
+    }
   }
 }
 
-template<typename T>
-void read_vector(std::istream& stream, std::vector<T>& array, std::function<T(std::istream&)> read_func) {
+template<typename T, typename ReadFunc = raw_layout_t>
+void read_vector(ByteReader& stream, std::vector<T>& array, ReadFunc read_func = {}) {
   uint32_t array_size = read<uint32_t>(stream);
-  for(auto i = 0u; i < array_size; i++) {
-    array.push_back(read_func(stream));
+  if constexpr (std::is_same_v<ReadFunc, raw_layout_t>) {
+    static_assert(is_raw_layout_v<T>, "Type needs an element read function");
+    if (array_size > stream.Remaining() / sizeof(T))
+      throw std::exception("Unexpected end of data");
+    // An empty vector's data() may be null, which memcpy mustn't be given.
+    if (array_size == 0)
+      return;
+    auto* bytes = stream.Take(array_size * sizeof(T));
+    auto old_size = array.size();
+    array.resize(old_size + array_size);
+    memcpy(array.data() + old_size, bytes, array_size * sizeof(T));
+  } else {
+    // Every element takes at least a byte, so don't trust a bogus count.
+    array.reserve(array.size() + std::min<size_t>(array_size, stream.Remaining()));
+    for(auto i = 0u; i < array_size; i++) {
+      array.push_back(read_func(stream));
+    }
   }
 }
 
+// Append-only, growable output buffer. Files are built up in memory and
+// then handed to the OS with a single write.
+class ByteWriter {
+public:
+  const uint8_t* data() const { return buffer_.data(); }
+  size_t size() const { return buffer_.size(); }
+
+  size_t Tell() const { return buffer_.size(); }
+  void Reserve(size_t capacity) { buffer_.reserve(capacity); }
+  void Put(uint8_t byte) { buffer_.push_back(byte); }
+  void Write(const void* data, size_t count) {
+    auto* bytes = (const uint8_t*)data;
+    buffer_.insert(buffer_.end(), bytes, bytes + count);
+  }
+  // Overwrites bytes that were already written, e.g. to fill in a chunk
+  // length once the chunk is complete.
+  void Patch(size_t pos, const void* data, size_t count) {
+    if (pos + count > buffer_.size())
+      throw std::exception("Attempt to patch past end of buffer");
+    memcpy(buffer_.data() + pos, data, count);
+  }
+  void WriteTo(std::ostream& stream) const {
+    stream.write((const char*)buffer_.data(), buffer_.size());
+  }
+
+private:
+  std::vector<uint8_t> buffer_;
+};
+
 template<typename T>
-void write(std::ostream& stream, const T& val) {
-  stream.write((char*)&val, sizeof(T));
+void write(ByteWriter& stream, const T& val) {
+  stream.Write(&val, sizeof(T));
 }
 
 template<typename T>
-void write_be(std::ostream& stream, const T& val) {
-  char* val_alias = (char*)&val;
+void write_be(ByteWriter& stream, const T& val) {
+  const uint8_t* val_alias = (const uint8_t*)&val;
+  uint8_t bytes[sizeof(T)];
   for(int i = 1; i <= sizeof(T); i++) {
-    stream.put(val_alias[sizeof(T) - i]);
+    bytes[i - 1] = val_alias[sizeof(T) - i];
   }
+  stream.Write(bytes, sizeof(T));
+}
+
+// Overwrites a little-endian value previously written at `pos`.
+template<typename T>
+void patch(ByteWriter& stream, size_t pos, const T& val) {
+  stream.Patch(pos, &val, sizeof(T));
+}
+
+// Overwrites a big-endian value previously written at `pos`.
+template<typename T>
+void patch_be(ByteWriter& stream, size_t pos, const T& val) {
+  const uint8_t* val_alias = (const uint8_t*)&val;
+  uint8_t bytes[sizeof(T)];
+  for(int i = 1; i <= sizeof(T); i++) {
+    bytes[i - 1] = val_alias[sizeof(T) - i];
+  }
+  stream.Patch(pos, bytes, sizeof(T));
 }
 
 // Writes a MIDI multi-byte value to the stream.
-void write_mb(std::ostream& stream, const uint32_t& value);
+inline void write_mb(ByteWriter& stream, uint32_t value) {
+  uint8_t bytes[5];
+  int i = sizeof(bytes) - 1;
+  bytes[i] = value & 0x7F;
+  while (value >>= 7) {
+    bytes[--i] = (value & 0x7F) | 0x80;
+  }
+  stream.Write(bytes + i, sizeof(bytes) - i);
+}
 // Writes a 24-bit integer (big-endian) to the stream
-void write_i24_be(std::ostream& stream, const uint32_t& value);
+inline void write_i24_be(ByteWriter& stream, uint32_t value) {
+  uint8_t bytes[3] = { (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+  stream.Write(bytes, 3);
+}
 // Writes a string with no length prefix.
-void write_str(std::ostream& stream, const std::string& string);
+inline void write_str(ByteWriter& stream, const std::string& string) {
+  stream.Write(string.data(), string.length());
+}
 // Writes a length prefixed string.
-void write_symbol(std::ostream& stream, const std::string& symbol);
+inline void write_symbol(ByteWriter& stream, const std::string& symbol) {
+  write<uint32_t>(stream, (uint32_t)symbol.length());
+  write_str(stream, symbol);
+}
 
-template<typename T>
-void write_array(std::ostream& stream, const T* data, size_t count, std::function<void(std::ostream&, const T&)> write_func) {
-  for(auto i = 0u; i < count; i++) {
-    write_func(stream, data[i]);
+template<typename T, typename WriteFunc = raw_layout_t>
+void write_array(ByteWriter& stream, const T* data, size_t count, WriteFunc write_func = {}) {
+  if constexpr (std::is_same_v<WriteFunc, raw_layout_t>) {
+    static_assert(is_raw_layout_v<T>, "Type needs an element write function");
+    stream.Write(data, count * sizeof(T));
+  } else {
+    for(auto i = 0u; i < count; i++) {
+      write_func(stream, data[i]);
+    }
   }
 }
 
-template<typename T>
-void write_vector(std::ostream& stream, const std::vector<T>& vector, std::function<void(std::ostream&, const T&)> write_func) {
-  write<uint32_t>(stream, vector.size());
-  for(const auto& el : vector) {
-    write_func(stream, el);
-  }
-}
\ No newline at end of file
+template<typename T, typename WriteFunc = raw_layout_t>
+void write_vector(ByteWriter& stream, const std::vector<T>& vector, WriteFunc write_func = {}) {
+  write<uint32_t>(stream, (uint32_t)vector.size());
+  write_array(stream, vector.data(), vector.size(), write_func);
+}